@@ -0,0 +1,87 @@
+#ifndef _NODE_POOL_H
+#define _NODE_POOL_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Аллокатор узлов деревьев: узлы выдаются из больших слэбов,
+// освобожденные узлы переиспользуются через список свободных ячеек,
+// а все дерево освобождается вместе с пулом за O(количество слэбов).
+template<class T, size_t SlabSize = 4096>
+class NodePool {
+    union Cell {
+        Cell *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+public:
+    // деструктор пула сам освобождает всю память, обходить дерево не нужно
+    static constexpr bool releasesAll = true;
+
+    NodePool() : freeList(nullptr), slabPos(SlabSize) {}
+
+    NodePool(const NodePool &) = delete;
+
+    NodePool &operator=(const NodePool &) = delete;
+
+    ~NodePool() {
+        for (auto slab : slabs) {
+            ::operator delete(slab, std::align_val_t(cacheLine));
+        }
+    }
+
+    template<class... Args>
+    T *create(Args &&... args) {
+        Cell *cell;
+        if (freeList) {
+            cell = freeList;
+            freeList = freeList->next;
+        } else {
+            if (slabPos == SlabSize) {
+                grow();
+            }
+            cell = slabs.back() + slabPos++;
+        }
+        return new(cell->storage) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T *node) {
+        node->~T();
+        Cell *cell = reinterpret_cast<Cell *>(node);
+        cell->next = freeList;
+        freeList = cell;
+    }
+
+private:
+    static constexpr size_t cacheLine = 64;
+
+    void grow() {
+        // слэбы выровнены по кэш-линии, чтобы узлы не пересекали границу линии без необходимости
+        void *memory = ::operator new(sizeof(Cell) * SlabSize, std::align_val_t(cacheLine));
+        slabs.push_back(static_cast<Cell *>(memory));
+        slabPos = 0;
+    }
+
+    std::vector<Cell *> slabs;
+    Cell *freeList;
+    size_t slabPos;
+};
+
+// Обычные new/delete для каждого узла: дерево само обходит и удаляет узлы
+template<class T>
+struct NewAllocator {
+    static constexpr bool releasesAll = false;
+
+    template<class... Args>
+    T *create(Args &&... args) {
+        return new T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T *node) {
+        delete node;
+    }
+};
+
+#endif //_NODE_POOL_H
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <vector>
 #include <stack>
+#include <type_traits>
+#include "../common/NodePool.h"
 
 template<class T>
 struct DefaultComparator {
@@ -9,7 +11,7 @@ struct DefaultComparator {
     }
 };
 
-template<class Key, class Comparator = DefaultComparator<Key>>
+template<class Key, class Comparator = DefaultComparator<Key>, template<class> class Allocator = NodePool>
 class Tree {
     struct Node {
         Key key;
@@ -25,8 +27,11 @@ public:
     Tree() : root(nullptr) {};
 
     ~Tree() {
-        _postOrder(root, [](Node * node) {
-            delete node;
+        if (Allocator<Node>::releasesAll && std::is_trivially_destructible<Node>::value) {
+            return; // узлы освободит пул
+        }
+        _postOrder(root, [this](Node * node) {
+            alloc.destroy(node);
         });
     }
 
@@ -37,6 +42,7 @@ public:
 private:
     Node *root;
     Comparator comp;
+    Allocator<Node> alloc;
 
     template<class Action>
     void _postOrder(Node *node, Action action);
@@ -54,10 +60,10 @@ int main() {
     return 0;
 }
 
-template<class Key, class Comparator>
-void Tree<Key, Comparator>::add(Key &key) {
+template<class Key, class Comparator, template<class> class Allocator>
+void Tree<Key, Comparator, Allocator>::add(Key &key) {
     if (!root) {
-        root = new Node(key);
+        root = alloc.create(key);
         return;
     }
     Node *curr = root;
@@ -66,23 +72,23 @@ void Tree<Key, Comparator>::add(Key &key) {
             if (curr->right) {
                 curr = curr->right;
             } else {
-                curr->right = new Node(key);
+                curr->right = alloc.create(key);
                 break;
             }
         } else {
             if (curr->left) {
                 curr = curr->left;
             } else {
-                curr->left = new Node(key);
+                curr->left = alloc.create(key);
                 break;
             }
         }
     }
 }
 
-template<class Key, class Comparator>
+template<class Key, class Comparator, template<class> class Allocator>
 template<class Action>
-void Tree<Key, Comparator>::_inOrder(Tree::Node *node, Action action) {
+void Tree<Key, Comparator, Allocator>::_inOrder(Tree::Node *node, Action action) {
     std::stack<Node *> history;
     while (!history.empty() || node) {
         if (node) {
@@ -97,9 +103,9 @@ void Tree<Key, Comparator>::_inOrder(Tree::Node *node, Action action) {
     }
 }
 
-template<class Key, class Comparator>
+template<class Key, class Comparator, template<class> class Allocator>
 template<class Action>
-void Tree<Key, Comparator>::_postOrder(Tree::Node * node, Action action) {
+void Tree<Key, Comparator, Allocator>::_postOrder(Tree::Node * node, Action action) {
     std::stack<Node *> history;
     Node * lastNode = nullptr;
     while (!history.empty() || node) {
@@ -119,8 +125,8 @@ void Tree<Key, Comparator>::_postOrder(Tree::Node * node, Action action) {
     }
 }
 
-template<class Key, class Comparator>
-void Tree<Key, Comparator>::print()  {
+template<class Key, class Comparator, template<class> class Allocator>
+void Tree<Key, Comparator, Allocator>::print()  {
     _inOrder(root, [](Node * node) {
         std::cout << node->key << " ";
     });
@@ -4,6 +4,8 @@
 #include <stack>
 #include <queue>
 #include <algorithm>
+#include <type_traits>
+#include "../common/NodePool.h"
 
 template<class T>
 struct DefaultComparator {
@@ -46,7 +48,7 @@ protected:
     }
 };
 
-template<class Key, class Comparator = DefaultComparator<Key>>
+template<class Key, class Comparator = DefaultComparator<Key>, template<class> class Allocator = NodePool>
 class Tree : public ITree {
     struct Node {
         Key key;
@@ -61,8 +63,11 @@ class Tree : public ITree {
 public:
     Tree() : root(nullptr) {};
     ~Tree() {
-        _postOrder(root, [](Node * node) {
-            delete node;
+        if (Allocator<Node>::releasesAll && std::is_trivially_destructible<Node>::value) {
+            return; // узлы освободит пул
+        }
+        _postOrder(root, [this](Node * node) {
+            alloc.destroy(node);
         });
     }
 
@@ -78,10 +83,11 @@ private:
 
     Node *root;
     Comparator comp;
+    Allocator<Node> alloc;
 };
 
 
-template<class Key, class Comparator = DefaultComparator<Key>>
+template<class Key, class Comparator = DefaultComparator<Key>, template<class> class Allocator = NodePool>
 class Treap : public ITree {
     struct Node {
         Key key;
@@ -101,8 +107,11 @@ class Treap : public ITree {
 public:
     Treap() : root(nullptr) {}
     ~Treap() {
-        _postOrder(root, [](Node * node) {
-            delete node;
+        if (Allocator<Node>::releasesAll && std::is_trivially_destructible<Node>::value) {
+            return; // узлы освободит пул
+        }
+        _postOrder(root, [this](Node * node) {
+            alloc.destroy(node);
         });
     }
     void add(Key &key, size_t priority);
@@ -121,6 +130,7 @@ private:
 
     Comparator comp;
     Node *root;
+    Allocator<Node> alloc;
 };
 
 void input(Treap<long> &treap, Tree<long> &tree);
@@ -151,18 +161,18 @@ int test(Treap<long> &treap, Tree<long> &tree) {
     return treap.maxWidth() - tree.maxWidth();
 }
 
-template<class Key, class Comparator>
-void Treap<Key, Comparator>::add(Key &key, size_t priority) {
+template<class Key, class Comparator, template<class> class Allocator>
+void Treap<Key, Comparator, Allocator>::add(Key &key, size_t priority) {
     _add(root, key, priority);
 }
 
 
-template<class Key, class Comparator>
-void Treap<Key, Comparator>::_add(Treap::Node *&node, Key &key, size_t priority) {
+template<class Key, class Comparator, template<class> class Allocator>
+void Treap<Key, Comparator, Allocator>::_add(Treap::Node *&node, Key &key, size_t priority) {
     if (!node) {
-        node = new Node(key, priority);
+        node = alloc.create(key, priority);
     } else if (node->priority < priority) {
-        Node *newNode = new Node(key, priority);
+        Node *newNode = alloc.create(key, priority);
         split(node, key, newNode->left, newNode->right);
         node = newNode;
     } else {
@@ -174,8 +184,8 @@ void Treap<Key, Comparator>::_add(Treap::Node *&node, Key &key, size_t priority)
     }
 }
 
-template<class Key, class Comparator>
-void Treap<Key, Comparator>::split(Treap::Node *node, Key &key, Treap::Node *&left, Treap::Node *&right) {
+template<class Key, class Comparator, template<class> class Allocator>
+void Treap<Key, Comparator, Allocator>::split(Treap::Node *node, Key &key, Treap::Node *&left, Treap::Node *&right) {
     if (!node) {
         left = nullptr;
         right = nullptr;
@@ -189,9 +199,9 @@ void Treap<Key, Comparator>::split(Treap::Node *node, Key &key, Treap::Node *&le
 }
 
 
-template<class Key, class Comparator>
+template<class Key, class Comparator, template<class> class Allocator>
 template<class Action>
-void Treap<Key, Comparator>::_postOrder(Treap::Node *&node, Action action) {
+void Treap<Key, Comparator, Allocator>::_postOrder(Treap::Node *&node, Action action) {
     if(!node) {
         return;
     }
@@ -200,10 +210,10 @@ void Treap<Key, Comparator>::_postOrder(Treap::Node *&node, Action action) {
     action(node);
 }
 
-template<class Key, class Comparator>
-void Tree<Key, Comparator>::add(Key &key) {
+template<class Key, class Comparator, template<class> class Allocator>
+void Tree<Key, Comparator, Allocator>::add(Key &key) {
     if (!root) {
-        root = new Node(key);
+        root = alloc.create(key);
         return;
     }
     Node *curr = root;
@@ -212,23 +222,23 @@ void Tree<Key, Comparator>::add(Key &key) {
             if (curr->right) {
                 curr = curr->right;
             } else {
-                curr->right = new Node(key);
+                curr->right = alloc.create(key);
                 break;
             }
         } else {
             if (curr->left) {
                 curr = curr->left;
             } else {
-                curr->left = new Node(key);
+                curr->left = alloc.create(key);
                 break;
             }
         }
     }
 }
 
-template<class Key, class Comparator>
+template<class Key, class Comparator, template<class> class Allocator>
 template<class Action>
-void Tree<Key, Comparator>::_postOrder(Tree::Node * node, Action action) {
+void Tree<Key, Comparator, Allocator>::_postOrder(Tree::Node * node, Action action) {
     std::stack<Node *> history;
     Node * lastNode = nullptr;
     while (!history.empty() || node) {
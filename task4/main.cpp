@@ -1,33 +1,171 @@
 #include <iostream>
+#include <string>
 #include <vector>
-#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <thread>
+#include <type_traits>
+#include "../common/NodePool.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 template<class T>
 struct DefaultComparator {
-    std::int8_t operator()(const T &l, const T &r) {
+    std::int8_t operator()(const T &l, const T &r) const {
         if (l < r) return -1;
         if (l > r) return 1;
         return 0;
     }
 };
 
-template<class Key, class Comparator=DefaultComparator<Key>>
-class AVLTree {
-    struct Node {
-        Node *left;
-        Node *right;
+// Запросы по весам поддеревьев. Узлы только читаются, поэтому обход общий
+// для AVLTree и для снимков PersistentAVLTree. Индексы, как и в insert/pop,
+// считаются со старшего элемента. Вес узла может включать несколько копий ключа,
+// поэтому их число берется как weight(node) - weight(left) - weight(right)
+template<class Key, class Node, class Comparator>
+struct OrderStatistics {
+    static constexpr size_t npos = static_cast<size_t>(-1);
 
-        Key key;
+    static size_t weight(const Node *node) {
+        return node ? node->weight : 0;
+    }
 
+    static size_t find(const Node *curr, const Key &key, const Comparator &comp) {
+        size_t greater = 0;
+        while (curr) {
+            std::int8_t compRes = comp(key, curr->key);
+            if (compRes < 0) {
+                greater += weight(curr) - weight(curr->left);
+                curr = curr->left;
+            } else if (compRes > 0) {
+                curr = curr->right;
+            } else {
+                return greater + weight(curr->right);
+            }
+        }
+        return npos;
+    }
+
+    static const Key &select(const Node *curr, size_t index) {
+        while (true) {
+            size_t rightWeight = weight(curr->right);
+            size_t notLeft = weight(curr) - weight(curr->left); // правое поддерево и копии ключа узла
+            if (index < rightWeight) {
+                curr = curr->right;
+            } else if (index < notLeft) {
+                return curr->key;
+            } else {
+                index -= notLeft;
+                curr = curr->left;
+            }
+        }
+    }
+
+    static size_t rank(const Node *curr, const Key &key, const Comparator &comp) {
+        size_t greater = 0;
+        while (curr) {
+            if (comp(key, curr->key) < 0) {
+                greater += weight(curr) - weight(curr->left);
+                curr = curr->left;
+            } else {
+                curr = curr->right;
+            }
+        }
+        return greater;
+    }
+
+    static void rank(const Node *node, const Key *first, const Key *last, size_t greater, size_t *ranks,
+                     const Comparator &comp) {
+        if (first == last) {
+            return;
+        }
+        if (!node) {
+            std::fill(ranks, ranks + (last - first), greater);
+            return;
+        }
+        // ключи меньше текущего уходят влево вместе с узлом и его правым поддеревом, остальные - вправо
+        const Key *middle = std::partition_point(first, last, [&comp, node](const Key &key) {
+            return comp(key, node->key) < 0;
+        });
+        rank(node->left, first, middle, greater + weight(node) - weight(node->left), ranks, comp);
+        rank(node->right, middle, last, greater, ranks + (middle - first), comp);
+    }
+
+    static size_t lowerBound(const Node *curr, const Key &key, const Comparator &comp) {
+        size_t less = 0;
+        while (curr) {
+            if (comp(curr->key, key) < 0) {
+                less += weight(curr) - weight(curr->right);
+                curr = curr->right;
+            } else {
+                curr = curr->left;
+            }
+        }
+        return less;
+    }
+
+    static size_t upperBound(const Node *curr, const Key &key, const Comparator &comp) {
+        size_t notGreater = 0;
+        while (curr) {
+            if (comp(key, curr->key) < 0) {
+                curr = curr->left;
+            } else {
+                notGreater += weight(curr) - weight(curr->right);
+                curr = curr->right;
+            }
+        }
+        return notGreater;
+    }
+
+    static size_t countInRange(const Node *root, const Key &from, const Key &to, const Comparator &comp) {
+        if (comp(to, from) < 0) {
+            return 0;
+        }
+        return upperBound(root, to, comp) - lowerBound(root, from, comp);
+    }
+};
+
+// Кратность ключа хранится в узле только в режиме мультимножества,
+// иначе у каждого узла ровно одна копия и место под счетчик не тратится
+template<bool Multiset>
+struct NodeCopies {
+    std::uint32_t copies = 1;
+};
+
+template<>
+struct NodeCopies<false> {
+    static constexpr std::uint32_t copies = 1;
+};
+
+// Multiset = true: равные ключи хранятся в одном узле со счетчиком копий, который входит в вес
+template<class Key, class Comparator=DefaultComparator<Key>, template<class> class Allocator=NodePool,
+        bool Multiset=false>
+class AVLTree {
+    // ключ, высота, вес и указатели на детей лежат подряд и для небольших ключей
+    // умещаются в одну кэш-линию (слэбы пула выровнены по 64 байта)
+    struct Node : NodeCopies<Multiset> {
+        Key key;
+        std::uint8_t height;
         size_t weight;
 
+        Node *left;
+        Node *right;
+
         Node(const Key &key)
-                : left(nullptr), right(nullptr),
-                  key(key),
-                  weight(1) {}
+                : key(key),
+                  height(1),
+                  weight(1),
+                  left(nullptr), right(nullptr) {}
     };
 
 public:
+    static constexpr size_t npos = OrderStatistics<Key, Node, Comparator>::npos;
+
     AVLTree() : root(nullptr) {}
 
     ~AVLTree();
@@ -38,9 +176,28 @@ public:
 
     size_t insert(const Key &key);
 
-    size_t find(const Key &key);
+    // индекс найденного ключа или npos, если ключа нет
+    size_t find(const Key &key) const;
+
+    // индексы здесь, как и в insert/pop, считаются со старшего элемента:
+    // select(0) - максимальный ключ, rank(key) - количество ключей больше key
+    const Key &select(size_t index) const;
+
+    size_t rank(const Key &key) const;
+
+    // ранги для отсортированного по возрастанию набора ключей за один общий спуск
+    void rank(const std::vector<Key> &sortedKeys, std::vector<size_t> &ranks) const;
+
+    // количество ключей меньше key и не больше key соответственно
+    size_t lowerBound(const Key &key) const;
+
+    size_t upperBound(const Key &key) const;
+
+    // количество ключей в отрезке [from, to]
+    size_t countInRange(const Key &from, const Key &to) const;
 
 
+    // ключи в прямом обходе дерева: узел, левое поддерево, правое
     void print() {
         _print(root);
     }
@@ -49,7 +206,9 @@ public:
         if (!node) {
             return;
         }
-        std::cout << node->key << std::endl;
+        for (std::uint32_t i = 0; i < node->copies; i++) {
+            std::cout << node->key << std::endl;
+        }
         _print(node->left);
         _print(node->right);
     }
@@ -57,98 +216,655 @@ public:
 
     void pop(size_t index);
 
+    // вставка отсортированного по возрастанию набора: из набора строится сбалансированное
+    // дерево, которое сливается с текущим через split/join. Ключи и их индексы те же, что после
+    // вставки по одному в порядке возрастания, но форма дерева и поэтому вывод print другие.
+    // threads - сколько потоков может занять слияние, 0 - по числу ядер; потоки запускаются
+    // только для наборов от parallelBatch ключей
+    void insertBatch(const std::vector<Key> &sortedKeys, unsigned threads = 0);
+
+    // то же, и индексы, которые вернули бы insert для каждого ключа набора
+    void insertBatch(const std::vector<Key> &sortedKeys, std::vector<size_t> &indices, unsigned threads = 0);
+
 private:
     template<class Action>
     void _postOrder(Action action, Node *node);
 
-    Node *balance(Node *node);
+    Node *build(const Key *keys, const std::uint32_t *copies, size_t count);
+
+    Node *join(Node *left, Node *middle, Node *right);
+
+    void split(Node *node, const Key &key, Node *&left, Node *&right, Node *&equal);
+
+    Node *unite(Node *tree, Node *batch, size_t parallelDepth, std::vector<Node *> &merged);
 
-    std::uint8_t height(Node *node) const;
+    Node *balance(Node *node);
 
-    std::size_t weight(Node *node) const;
+    std::uint8_t height(const Node *node) const;
 
-    Node *popMin(Node *node, Node *& minNode);
+    std::size_t weight(const Node *node) const;
 
     std::int8_t balanceFactor(Node *node);
 
-    void setWeight(Node *node);
+    void update(Node *node);
+
+    void retrace(Node **path[], size_t depth);
+
+    Node *rotateRight(Node *node);
+
+    Node *rotateLeft(Node *node);
+
+    // высота AVL-дерева не превосходит 1.44 * log2(n + 2), для 64-битного size_t это меньше 96
+    static constexpr size_t maxHeight = 96;
+
+    // меньшие наборы сливаются в одном потоке: запуск потока дороже самого слияния
+    static constexpr size_t parallelBatch = 1 << 14;
+
+    using Statistics = OrderStatistics<Key, Node, Comparator>;
+
+    Node *root;
+    Comparator comp;
+    Allocator<Node> alloc;
+};
+
+// Персистентное AVL-дерево для одного писателя и многих читателей. Запись копирует
+// только путь, который меняет, и атомарно публикует новый корень, а опубликованные
+// узлы больше не меняются. Читатели берут снимок (Snapshot) и работают с ним без блокировок
+// и без ожидания: взятие снимка - один проход по maxReaders слотам, и если все заняты,
+// снимок не выдается. Старые узлы освобождаются по эпохам: узел, замененный в эпоху E,
+// удаляется, когда все активные снимки взяты в эпоху позже E
+template<class Key, class Comparator=DefaultComparator<Key>>
+class PersistentAVLTree {
+    struct Node {
+        Key key;
+        std::uint8_t height;
+        size_t weight;
+
+        const Node *left;
+        const Node *right;
+
+        size_t version; // номер записи, создавшей узел: такие узлы еще не опубликованы и меняются на месте
+
+        Node(const Key &key, size_t version)
+                : key(key),
+                  height(1),
+                  weight(1),
+                  left(nullptr), right(nullptr),
+                  version(version) {}
+    };
+
+    using Statistics = OrderStatistics<Key, Node, Comparator>;
+
+public:
+    static constexpr size_t npos = Statistics::npos;
+
+    // одновременно живущих снимков не больше maxReaders
+    static constexpr size_t maxReaders = 64;
+
+    // Снимок, взятый при занятых слотах, недействителен: valid() == false, и запросы к нему
+    // видят пустое дерево. Повторить попытку или подождать решает сам читатель
+
+    class Snapshot {
+    public:
+        Snapshot(Snapshot &&other) noexcept : slot(other.slot), root(other.root), comp(other.comp) {
+            other.slot = nullptr;
+        }
 
-    Node *_insert(Node *node, const Key &key, size_t & indexCounter);
+        Snapshot &operator=(Snapshot &&other) noexcept {
+            if (this != &other) {
+                release();
+                slot = other.slot;
+                root = other.root;
+                comp = other.comp;
+                other.slot = nullptr;
+            }
+            return *this;
+        }
+
+        ~Snapshot() {
+            release();
+        }
+
+        bool valid() const {
+            return slot != nullptr;
+        }
+
+        size_t size() const {
+            return Statistics::weight(root);
+        }
+
+        size_t find(const Key &key) const {
+            return Statistics::find(root, key, *comp);
+        }
+
+        const Key &select(size_t index) const {
+            return Statistics::select(root, index);
+        }
+
+        size_t rank(const Key &key) const {
+            return Statistics::rank(root, key, *comp);
+        }
+
+        size_t lowerBound(const Key &key) const {
+            return Statistics::lowerBound(root, key, *comp);
+        }
+
+        size_t upperBound(const Key &key) const {
+            return Statistics::upperBound(root, key, *comp);
+        }
+
+        size_t countInRange(const Key &from, const Key &to) const {
+            return Statistics::countInRange(root, from, to, *comp);
+        }
+
+    private:
+        friend class PersistentAVLTree;
+
+        Snapshot(std::atomic<std::uint64_t> *slot, const Node *root, const Comparator *comp)
+                : slot(slot), root(root), comp(comp) {}
+
+        void release() {
+            if (slot) {
+                slot->store(0);
+                slot = nullptr;
+            }
+        }
+
+        std::atomic<std::uint64_t> *slot;
+        const Node *root;
+        const Comparator *comp;
+    };
+
+    PersistentAVLTree() : root(nullptr), epoch(1), writeVersion(0) {
+        for (auto &readerEpoch : readerEpochs) {
+            readerEpoch.store(0);
+        }
+    }
 
-    Node *_pop(Node *node, size_t index, size_t &counter);
+    ~PersistentAVLTree();
+
+    // снимок текущей версии, можно брать из любого потока; недействителен, если заняты все слоты
+    Snapshot snapshot() const;
+
+    // запись - только из одного потока
+    size_t insert(const Key &key);
+
+    void pop(size_t index);
+
+    size_t size() const {
+        return Statistics::weight(root.load());
+    }
+
+private:
+    Node *_insert(const Node *node, const Key &key, size_t &index);
+
+    const Node *_pop(const Node *node, size_t index);
+
+    const Node *popMin(const Node *node, const Node *&minNode);
+
+    Node *balance(Node *node);
 
     Node *rotateRight(Node *node);
 
     Node *rotateLeft(Node *node);
 
+    void update(Node *node);
+
+    std::int8_t balanceFactor(const Node *node) const;
+
+    static std::uint8_t height(const Node *node) {
+        return node ? node->height : 0;
+    }
+
+    // узел, который можно менять в текущей записи: свежий узел или копия опубликованного
+    Node *own(const Node *node);
+
+    void retire(const Node *node);
+
+    void publish(const Node *newRoot);
+
+    void reclaim();
+
+    std::atomic<const Node *> root;
+    std::atomic<std::uint64_t> epoch;
+    mutable std::atomic<std::uint64_t> readerEpochs[maxReaders]; // 0 - слот свободен
+    size_t writeVersion;
+    std::vector<const Node *> replaced; // узлы, замененные текущей записью
+    std::deque<std::pair<std::uint64_t, const Node *>> retired;
+    Comparator comp;
+    NodePool<Node> alloc;
+};
+
+// B+-дерево с тем же интерфейсом, что и AVLTree: ключи лежат в листах по LeafSize,
+// внутренние узлы хранят количество ключей в каждом ребенке, поэтому спуск по индексу
+// идет по плотным массивам и касается нескольких кэш-линий на уровень
+template<class Key, class Comparator=DefaultComparator<Key>, size_t LeafSize=128, size_t Fanout=64>
+class BPlusTree {
+    struct Node {
+        std::uint32_t count;
+
+        Node() : count(0) {}
+    };
+
+    struct Leaf : Node {
+        Key keys[LeafSize];
+    };
+
+    // separators[i] - нижняя граница ключей ребенка i (separators[0] не используется)
+    struct Inner : Node {
+        std::uint32_t sizes[Fanout];
+        Key separators[Fanout];
+        Node *children[Fanout];
+    };
+
+public:
+    BPlusTree() : root(nullptr), levels(0), total(0) {}
+
+    ~BPlusTree();
+
+    size_t size() const {
+        return total;
+    }
+
+    size_t insert(const Key &key);
+
+    void pop(size_t index);
+
+    // ключи в порядке индексов: от старшего к младшему
+    void print() {
+        _print(root, levels);
+    }
+
+private:
+    Node *_insert(Node *node, size_t level, const Key &key, size_t &greater, Key &separator);
+
+    void _pop(Node *node, size_t level, size_t pos);
+
+    void fixUnderflow(Inner *parent, size_t child, size_t level);
+
+    void _print(Node *node, size_t level);
+
+    template<class Action>
+    void _postOrder(Action action, Node *node, size_t level);
+
+    size_t nodeSize(Node *node, size_t level) const;
+
+    static size_t childByPosition(const std::uint32_t *sizes, size_t count, size_t &pos);
+
+    static size_t capacity(size_t level) {
+        return level == 0 ? LeafSize : Fanout;
+    }
+
+    bool less(const Key &l, const Key &r) const {
+        return comp(l, r) < 0;
+    }
+
     Node *root;
+    size_t levels; // 0 - корень является листом
+    size_t total;
     Comparator comp;
+    NodePool<Leaf> leaves;
+    NodePool<Inner> inners;
 };
 
+// Дерево Фенвика над сжатыми координатами ключей: количество копий каждого ключа
+class FenwickTree {
+public:
+    explicit FenwickTree(size_t size) : tree(size + 1, 0), total(0) {
+        highBit = 1;
+        while (highBit * 2 <= size) {
+            highBit *= 2;
+        }
+    }
+
+    void add(size_t pos, std::int32_t delta) {
+        total += delta;
+        for (pos++; pos < tree.size(); pos += pos & (~pos + 1)) {
+            tree[pos] += delta;
+        }
+    }
+
+    // количество элементов на позициях [0, pos]
+    size_t prefix(size_t pos) const {
+        size_t sum = 0;
+        for (pos++; pos > 0; pos -= pos & (~pos + 1)) {
+            sum += tree[pos];
+        }
+        return sum;
+    }
+
+    // позиция k-го по возрастанию элемента (с нуля), спуск по степеням двойки
+    size_t findByOrder(size_t k) const {
+        size_t pos = 0;
+        for (size_t step = highBit; step > 0; step /= 2) {
+            if (pos + step < tree.size() && tree[pos + step] <= k) {
+                pos += step;
+                k -= tree[pos];
+            }
+        }
+        return pos;
+    }
+
+    size_t size() const {
+        return total;
+    }
 
-void test(AVLTree<int> &tree);
+private:
+    std::vector<std::uint32_t> tree;
+    size_t highBit;
+    size_t total;
+};
+
+template<class Tree>
+void test(Tree &tree);
+
+// тот же поток команд, но ответы считаются после чтения всего потока на плоских массивах;
+// в конце ключи печатаются в порядке индексов, как у --btree, а не прямым обходом AVL-дерева
+void testOffline();
 
-int main() {
+// task4/tree_test.cpp подключает этот файл целиком со своим main
+#ifndef TASK4_NO_MAIN
+int main(int argc, char **argv) {
+    if (argc > 1 && std::string(argv[1]) == "--offline") {
+        testOffline();
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--multiset") {
+        AVLTree<int, DefaultComparator<int>, NodePool, true> tree;
+        test(tree);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--btree") {
+        BPlusTree<int> tree;
+        test(tree);
+        return 0;
+    }
     AVLTree<int> tree;
     test(tree);
     return 0;
 }
+#endif
 
-template<class Key, class Comparator>
-typename AVLTree<Key, Comparator>::Node *
-AVLTree<Key, Comparator>::_insert(AVLTree::Node *node, const Key &key, size_t & indexCounter) {
-    if (!node) {
-        return new Node(key);
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+size_t AVLTree<Key, Comparator, Allocator, Multiset>::insert(const Key &key) {
+    Node **path[maxHeight]; // ссылки на узлы, через которые прошел спуск
+    size_t depth = 0;
+    size_t index = 0;
+    Node **link = &root;
+    while (*link) {
+        Node *node = *link;
+        path[depth++] = link;
+        node->weight++;
+        std::int8_t compRes = comp(key, node->key);
+        if constexpr (Multiset) {
+            if (compRes == 0) { // еще одна копия: форма дерева не меняется
+                node->copies++;
+                return index + weight(node->right);
+            }
+        }
+        if (compRes < 0) {
+            index += weight(node->right) + node->copies; // узел и его правое поддерево окажутся правее нового ключа
+            link = &node->left;
+        } else {
+            link = &node->right;
+        }
+    }
+    *link = alloc.create(key);
+    retrace(path, depth);
+    return index;
+}
+
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+void AVLTree<Key, Comparator, Allocator, Multiset>::pop(size_t index) {
+    if (index >= size()) {
+        return;
+    }
+    Node **path[maxHeight];
+    size_t depth = 0;
+    Node **link = &root;
+    while (true) {
+        Node *node = *link;
+        size_t rightWeight = weight(node->right);
+        if (index >= rightWeight && index < rightWeight + node->copies) {
+            break;
+        }
+        path[depth++] = link;
+        node->weight--;
+        if (index < rightWeight) { // индексы считаются со старших элементов, поэтому идем вправо
+            link = &node->right;
+        } else {
+            index -= rightWeight + node->copies;
+            link = &node->left;
+        }
+    }
+
+    Node *target = *link;
+    if constexpr (Multiset) {
+        if (target->copies > 1) {
+            target->copies--;
+            target->weight--;
+            return;
+        }
     }
-    if (comp(key, node->key) < 0) {
-        indexCounter += node->left ? weight(node->left->right) + 1: 1;
-        node->left = _insert(node->left, key, indexCounter);
+    if (!target->right) {
+        *link = target->left;
+        alloc.destroy(target);
+        retrace(path, depth);
+        return;
+    }
+
+    // на место удаляемого узла ставим минимальный узел правого поддерева
+    size_t targetDepth = depth;
+    path[depth++] = link;
+    size_t minPathStart = depth;
+    Node **minLink = &target->right;
+    while ((*minLink)->left) {
+        path[depth++] = minLink;
+        minLink = &(*minLink)->left;
+    }
+    Node *minNode = *minLink;
+    for (size_t i = minPathStart; i < depth; i++) {
+        (*path[i])->weight -= minNode->copies; // минимальный узел уходит из этих поддеревьев со всеми копиями
+    }
+    *minLink = minNode->right;
+    minNode->left = target->left;
+    minNode->right = target->right;
+    minNode->weight = target->weight - 1;
+    minNode->height = target->height;
+    if (depth > targetDepth + 1) {
+        path[targetDepth + 1] = &minNode->right; // раньше эта ссылка указывала внутрь удаленного узла
+    }
+    *link = minNode;
+    alloc.destroy(target);
+    retrace(path, depth);
+}
+
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+void AVLTree<Key, Comparator, Allocator, Multiset>::insertBatch(const std::vector<Key> &sortedKeys,
+                                                               std::vector<size_t> &indices, unsigned threads) {
+    // ключи набора, вставленные раньше, не больше текущего, поэтому индекс каждого -
+    // это количество ключей дерева, больших его, до вставки
+    rank(sortedKeys, indices);
+    insertBatch(sortedKeys, threads);
+}
+
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+void AVLTree<Key, Comparator, Allocator, Multiset>::insertBatch(const std::vector<Key> &sortedKeys, unsigned threads) {
+    if (sortedKeys.empty()) {
+        return;
+    }
+    Node *batch;
+    if constexpr (Multiset) { // равные ключи набора сразу собираются в один узел
+        std::vector<Key> keys;
+        std::vector<std::uint32_t> copies;
+        for (const Key &key : sortedKeys) {
+            if (!keys.empty() && comp(keys.back(), key) == 0) {
+                copies.back()++;
+            } else {
+                keys.push_back(key);
+                copies.push_back(1);
+            }
+        }
+        batch = build(keys.data(), copies.data(), keys.size());
     } else {
-        indexCounter -= node->right ? weight(node->right->left) + 1: 0;
-        node->right = _insert(node->right, key, indexCounter);
+        batch = build(sortedKeys.data(), nullptr, sortedKeys.size());
+    }
+
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    // на каждом уровне рекурсии левая половина уходит в новый поток
+    size_t parallelDepth = 0;
+    for (; threads > 1; threads /= 2) {
+        parallelDepth++;
+    }
+    if (sortedKeys.size() < parallelBatch) {
+        parallelDepth = 0;
+    }
+    std::vector<Node *> merged;
+    root = unite(root, batch, parallelDepth, merged);
+    for (Node *node : merged) {
+        alloc.destroy(node);
     }
+}
 
-    return balance(node);
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+typename AVLTree<Key, Comparator, Allocator, Multiset>::Node *
+AVLTree<Key, Comparator, Allocator, Multiset>::build(const Key *keys, const std::uint32_t *copies, size_t count) {
+    if (count == 0) {
+        return nullptr;
+    }
+    size_t middle = count / 2;
+    Node *node = alloc.create(keys[middle]);
+    if constexpr (Multiset) {
+        node->copies = copies[middle];
+    }
+    node->left = build(keys, copies, middle);
+    node->right = build(keys + middle + 1, copies ? copies + middle + 1 : nullptr, count - middle - 1);
+    update(node);
+    return node;
 }
 
-template<class Key, class Comparator>
-size_t AVLTree<Key, Comparator>::insert(const Key &key) {
-    size_t currIndex = root ? weight(root->right) : 0;
-    root = _insert(root, key, currIndex);
-    return currIndex;
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+typename AVLTree<Key, Comparator, Allocator, Multiset>::Node *
+AVLTree<Key, Comparator, Allocator, Multiset>::join(Node *left, Node *middle, Node *right) {
+    // спускаемся по краю более высокого дерева до поддерева сравнимой высоты,
+    // на обратном пути высота растет не больше чем на 1, и хватает обычной балансировки
+    if (height(left) > height(right) + 1) {
+        left->right = join(left->right, middle, right);
+        return balance(left);
+    }
+    if (height(right) > height(left) + 1) {
+        right->left = join(left, middle, right->left);
+        return balance(right);
+    }
+    middle->left = left;
+    middle->right = right;
+    update(middle);
+    return middle;
 }
 
-template<class Key, class Comparator>
-void AVLTree<Key, Comparator>::pop(size_t index) {
-    size_t currIndex = weight(root->right);
-    root = _pop(root, index, currIndex);
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+void AVLTree<Key, Comparator, Allocator, Multiset>::split(Node *node, const Key &key,
+                                                         Node *&left, Node *&right, Node *&equal) {
+    // left - ключи не больше key (строго меньше в режиме мультимножества), right - больше,
+    // equal - узел с ключом key в режиме мультимножества
+    if (!node) {
+        left = nullptr;
+        right = nullptr;
+        return;
+    }
+    std::int8_t compRes = comp(key, node->key);
+    if (Multiset && compRes == 0) {
+        equal = node;
+        left = node->left;
+        right = node->right;
+    } else if (compRes < 0) {
+        Node *rest;
+        split(node->left, key, left, rest, equal);
+        right = join(rest, node, node->right);
+    } else {
+        Node *rest;
+        split(node->right, key, rest, right, equal);
+        left = join(node->left, node, rest);
+    }
 }
 
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+typename AVLTree<Key, Comparator, Allocator, Multiset>::Node *
+AVLTree<Key, Comparator, Allocator, Multiset>::unite(Node *tree, Node *batch, size_t parallelDepth,
+                                                    std::vector<Node *> &merged) {
+    if (!batch) {
+        return tree;
+    }
+    if (!tree) {
+        return batch;
+    }
+    Node *left, *right, *equal = nullptr;
+    split(tree, batch->key, left, right, equal);
+    if constexpr (Multiset) {
+        if (equal) {
+            batch->copies += equal->copies;
+            merged.push_back(equal); // освобождается после слияния: пул не потокобезопасен
+        }
+    }
+    Node *batchLeft = batch->left;
+    Node *batchRight = batch->right;
+    if (parallelDepth > 0 && weight(batch) >= parallelBatch) {
+        // половины независимы: левая сливается в отдельном потоке
+        std::vector<Node *> leftMerged;
+        auto leftPart = std::async(std::launch::async, [this, left, batchLeft, parallelDepth, &leftMerged]() {
+            return unite(left, batchLeft, parallelDepth - 1, leftMerged);
+        });
+        right = unite(right, batchRight, parallelDepth - 1, merged);
+        left = leftPart.get();
+        merged.insert(merged.end(), leftMerged.begin(), leftMerged.end());
+    } else {
+        left = unite(left, batchLeft, 0, merged);
+        right = unite(right, batchRight, 0, merged);
+    }
+    return join(left, batch, right);
+}
 
-template<class Key, class Comparator>
-std::int8_t AVLTree<Key, Comparator>::balanceFactor(AVLTree<Key, Comparator>::Node *node) {
-    return height(node->right) - height(node->left);
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+void AVLTree<Key, Comparator, Allocator, Multiset>::retrace(Node **path[], size_t depth) {
+    // веса уже поправлены при спуске, поэтому как только высота поддерева
+    // перестала меняться, выше балансировать нечего
+    while (depth > 0) {
+        Node **link = path[--depth];
+        std::uint8_t oldHeight = (*link)->height;
+        *link = balance(*link);
+        if ((*link)->height == oldHeight) {
+            break;
+        }
+    }
 }
 
-template<class Key, class Comparator>
-std::uint8_t AVLTree<Key, Comparator>::height(AVLTree::Node *node) const {
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+std::int8_t AVLTree<Key, Comparator, Allocator, Multiset>::balanceFactor(AVLTree<Key, Comparator, Allocator, Multiset>::Node *node) {
+    return static_cast<std::int8_t>(height(node->right) - height(node->left));
+}
+
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+std::uint8_t AVLTree<Key, Comparator, Allocator, Multiset>::height(const AVLTree::Node *node) const {
     if (!node) {
         return 0;
     }
-    return std::floor(std::log2(node->weight)) + 1;
+    return node->height;
 }
 
-template<class Key, class Comparator>
-void AVLTree<Key, Comparator>::setWeight(AVLTree::Node *node) {
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+void AVLTree<Key, Comparator, Allocator, Multiset>::update(AVLTree::Node *node) {
     if (!node) {
         return;
     }
-    node->weight = weight(node->left) + weight(node->right) + 1;
+    node->weight = weight(node->left) + weight(node->right) + node->copies;
+    node->height = std::max(height(node->left), height(node->right)) + 1;
 }
 
-template<class Key, class Comparator>
-typename AVLTree<Key, Comparator>::Node *AVLTree<Key, Comparator>::balance(AVLTree::Node *node) {
-    setWeight(node);
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+typename AVLTree<Key, Comparator, Allocator, Multiset>::Node *AVLTree<Key, Comparator, Allocator, Multiset>::balance(AVLTree::Node *node) {
+    update(node);
 
     std::int8_t bf = balanceFactor(node);
 
@@ -166,60 +882,75 @@ typename AVLTree<Key, Comparator>::Node *AVLTree<Key, Comparator>::balance(AVLTr
     return node;
 }
 
-template<class Key, class Comparator>
-typename AVLTree<Key, Comparator>::Node *AVLTree<Key, Comparator>::rotateRight(AVLTree::Node *node) {
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+typename AVLTree<Key, Comparator, Allocator, Multiset>::Node *AVLTree<Key, Comparator, Allocator, Multiset>::rotateRight(AVLTree::Node *node) {
     Node *temp = node->left;
     node->left = temp->right;
     temp->right = node;
-    setWeight(node);
-    setWeight(temp);
+    update(node);
+    update(temp);
     return temp;
 }
 
-template<class Key, class Comparator>
-typename AVLTree<Key, Comparator>::Node *AVLTree<Key, Comparator>::rotateLeft(AVLTree::Node *node) {
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+typename AVLTree<Key, Comparator, Allocator, Multiset>::Node *AVLTree<Key, Comparator, Allocator, Multiset>::rotateLeft(AVLTree::Node *node) {
     Node *temp = node->right;
     node->right = temp->left;
     temp->left = node;
-    setWeight(node);
-    setWeight(temp);
+    update(node);
+    update(temp);
     return temp;
 }
 
-template<class Key, class Comparator>
-size_t AVLTree<Key, Comparator>::size() const {
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+size_t AVLTree<Key, Comparator, Allocator, Multiset>::size() const {
     return weight(root);
 }
 
-template<class Key, class Comparator>
-std::uint8_t AVLTree<Key, Comparator>::height() const {
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+std::uint8_t AVLTree<Key, Comparator, Allocator, Multiset>::height() const {
     return height(root);
 }
 
-template<class Key, class Comparator>
-size_t AVLTree<Key, Comparator>::find(const Key &key) {
-    Node * curr = root;
-    size_t index = weight(root->right);
-    while(true) {
-        if (!curr) {
-            return 335;
-        }
-        std::int8_t compRes = comp(key, curr->key);
-        if (compRes < 0) {
-            curr = curr->left;
-            index += weight(curr->right) + 1;
-        } else if (compRes > 0) {
-            curr = curr->right;
-            index -= weight(curr->left) + 1;
-        } else {
-            return index;
-        }
-    }
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+size_t AVLTree<Key, Comparator, Allocator, Multiset>::find(const Key &key) const {
+    return Statistics::find(root, key, comp);
 }
 
-template<class Key, class Comparator>
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+const Key &AVLTree<Key, Comparator, Allocator, Multiset>::select(size_t index) const {
+    return Statistics::select(root, index); // index < size() - на совести вызывающего, как и в pop
+}
+
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+size_t AVLTree<Key, Comparator, Allocator, Multiset>::rank(const Key &key) const {
+    return Statistics::rank(root, key, comp);
+}
+
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+void AVLTree<Key, Comparator, Allocator, Multiset>::rank(const std::vector<Key> &sortedKeys, std::vector<size_t> &ranks) const {
+    ranks.resize(sortedKeys.size());
+    Statistics::rank(root, sortedKeys.data(), sortedKeys.data() + sortedKeys.size(), 0, ranks.data(), comp);
+}
+
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+size_t AVLTree<Key, Comparator, Allocator, Multiset>::lowerBound(const Key &key) const {
+    return Statistics::lowerBound(root, key, comp);
+}
+
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+size_t AVLTree<Key, Comparator, Allocator, Multiset>::upperBound(const Key &key) const {
+    return Statistics::upperBound(root, key, comp);
+}
+
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+size_t AVLTree<Key, Comparator, Allocator, Multiset>::countInRange(const Key &from, const Key &to) const {
+    return Statistics::countInRange(root, from, to, comp);
+}
+
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
 template<class Action>
-void AVLTree<Key, Comparator>::_postOrder(Action action, AVLTree::Node *node) {
+void AVLTree<Key, Comparator, Allocator, Multiset>::_postOrder(Action action, AVLTree::Node *node) {
     if (!node) {
         return;
     }
@@ -228,15 +959,18 @@ void AVLTree<Key, Comparator>::_postOrder(Action action, AVLTree::Node *node) {
     action(node);
 }
 
-template<class Key, class Comparator>
-AVLTree<Key, Comparator>::~AVLTree() {
-    _postOrder([](Node *node) {
-        delete node;
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+AVLTree<Key, Comparator, Allocator, Multiset>::~AVLTree() {
+    if (Allocator<Node>::releasesAll && std::is_trivially_destructible<Node>::value) {
+        return; // узлы освободит пул
+    }
+    _postOrder([this](Node *node) {
+        alloc.destroy(node);
     }, root);
 }
 
-template<class Key, class Comparator>
-std::size_t AVLTree<Key, Comparator>::weight(AVLTree::Node *node) const {
+template<class Key, class Comparator, template<class> class Allocator, bool Multiset>
+std::size_t AVLTree<Key, Comparator, Allocator, Multiset>::weight(const AVLTree::Node *node) const {
     if (!node) {
         return 0;
     }
@@ -244,48 +978,501 @@ std::size_t AVLTree<Key, Comparator>::weight(AVLTree::Node *node) const {
 }
 
 template<class Key, class Comparator>
-typename AVLTree<Key, Comparator>::Node *AVLTree<Key, Comparator>::_pop(AVLTree::Node *node, size_t index, size_t &counter) {
-    if (!node) {
-        return nullptr;
+PersistentAVLTree<Key, Comparator>::~PersistentAVLTree() {
+    if (std::is_trivially_destructible<Key>::value) {
+        return; // узлы освободит пул
     }
+    for (auto &entry : retired) {
+        alloc.destroy(const_cast<Node *>(entry.second));
+    }
+    std::vector<const Node *> history;
+    if (root.load()) {
+        history.push_back(root.load());
+    }
+    while (!history.empty()) {
+        const Node *node = history.back();
+        history.pop_back();
+        if (node->left) {
+            history.push_back(node->left);
+        }
+        if (node->right) {
+            history.push_back(node->right);
+        }
+        alloc.destroy(const_cast<Node *>(node));
+    }
+}
 
-    if (counter == index) {
-        Node *left = node->left;
-        Node *right = node->right;
-        delete node;
-
-        if (!right) {
-            return left;
+template<class Key, class Comparator>
+typename PersistentAVLTree<Key, Comparator>::Snapshot PersistentAVLTree<Key, Comparator>::snapshot() const {
+    for (auto &readerEpoch : readerEpochs) {
+        std::uint64_t freeSlot = 0;
+        // эпоха объявляется до чтения корня: писатель не освободит ничего, что доступно из этого корня
+        if (readerEpoch.compare_exchange_strong(freeSlot, epoch.load())) {
+            return Snapshot(&readerEpoch, root.load(), &comp);
         }
+    }
+    return Snapshot(nullptr, nullptr, &comp);
+}
 
-        Node *minNode = nullptr;
-        right = popMin(right, minNode);
-        minNode->right = right;
-        minNode->left = left;
+template<class Key, class Comparator>
+size_t PersistentAVLTree<Key, Comparator>::insert(const Key &key) {
+    writeVersion++;
+    size_t index = 0;
+    publish(_insert(root.load(), key, index));
+    return index;
+}
 
-        return balance(minNode);
-    } else if (index < counter) { // искомый индек меньше индекса текущего элемента, значит идем вправо (индекс со старших)
-        counter -= node->right ? weight(node->right->left) + 1 : 0;
-        node->right = _pop(node->right, index, counter);
+template<class Key, class Comparator>
+void PersistentAVLTree<Key, Comparator>::pop(size_t index) {
+    if (index >= size()) {
+        return;
+    }
+    writeVersion++;
+    publish(_pop(root.load(), index));
+}
+
+template<class Key, class Comparator>
+typename PersistentAVLTree<Key, Comparator>::Node *
+PersistentAVLTree<Key, Comparator>::_insert(const Node *node, const Key &key, size_t &index) {
+    if (!node) {
+        return alloc.create(key, writeVersion);
+    }
+    Node *copy = own(node);
+    if (comp(key, copy->key) < 0) {
+        index += Statistics::weight(copy->right) + 1;
+        copy->left = _insert(copy->left, key, index);
     } else {
-        counter += node->left ? weight(node->left->right) + 1 : 0;
-        node->left = _pop(node->left, index, counter);
-    };
+        copy->right = _insert(copy->right, key, index);
+    }
+    return balance(copy);
+}
 
-    return balance(node);
+template<class Key, class Comparator>
+const typename PersistentAVLTree<Key, Comparator>::Node *
+PersistentAVLTree<Key, Comparator>::_pop(const Node *node, size_t index) {
+    size_t rightWeight = Statistics::weight(node->right);
+    if (index != rightWeight) {
+        Node *copy = own(node);
+        if (index < rightWeight) {
+            copy->right = _pop(copy->right, index);
+        } else {
+            copy->left = _pop(copy->left, index - rightWeight - 1);
+        }
+        return balance(copy);
+    }
+
+    const Node *left = node->left;
+    const Node *right = node->right;
+    retire(node);
+    if (!right) {
+        return left;
+    }
+    const Node *minNode = nullptr;
+    right = popMin(right, minNode);
+    Node *replacement = own(minNode);
+    replacement->left = left;
+    replacement->right = right;
+    return balance(replacement);
 }
 
 template<class Key, class Comparator>
-typename AVLTree<Key, Comparator>::Node *AVLTree<Key, Comparator>::popMin(Node *node, Node *& minNode) {
+const typename PersistentAVLTree<Key, Comparator>::Node *
+PersistentAVLTree<Key, Comparator>::popMin(const Node *node, const Node *&minNode) {
     if (!node->left) {
         minNode = node;
         return node->right;
     }
-    node->left = popMin(node->left, minNode);
-    return balance(node);
+    Node *copy = own(node);
+    copy->left = popMin(copy->left, minNode);
+    return balance(copy);
+}
+
+template<class Key, class Comparator>
+typename PersistentAVLTree<Key, Comparator>::Node *PersistentAVLTree<Key, Comparator>::balance(Node *node) {
+    update(node);
+
+    std::int8_t bf = balanceFactor(node);
+
+    if (bf == 2) {
+        if (balanceFactor(node->right) < 0) {
+            node->right = rotateRight(own(node->right));
+        }
+        return rotateLeft(node);
+    } else if (bf == -2) {
+        if (balanceFactor(node->left) > 0) {
+            node->left = rotateLeft(own(node->left));
+        }
+        return rotateRight(node);
+    }
+    return node;
+}
+
+template<class Key, class Comparator>
+typename PersistentAVLTree<Key, Comparator>::Node *PersistentAVLTree<Key, Comparator>::rotateRight(Node *node) {
+    Node *temp = own(node->left);
+    node->left = temp->right;
+    temp->right = node;
+    update(node);
+    update(temp);
+    return temp;
 }
 
-void test(AVLTree<int> &tree) {
+template<class Key, class Comparator>
+typename PersistentAVLTree<Key, Comparator>::Node *PersistentAVLTree<Key, Comparator>::rotateLeft(Node *node) {
+    Node *temp = own(node->right);
+    node->right = temp->left;
+    temp->left = node;
+    update(node);
+    update(temp);
+    return temp;
+}
+
+template<class Key, class Comparator>
+void PersistentAVLTree<Key, Comparator>::update(Node *node) {
+    node->weight = Statistics::weight(node->left) + Statistics::weight(node->right) + 1;
+    node->height = std::max(height(node->left), height(node->right)) + 1;
+}
+
+template<class Key, class Comparator>
+std::int8_t PersistentAVLTree<Key, Comparator>::balanceFactor(const Node *node) const {
+    return static_cast<std::int8_t>(height(node->right) - height(node->left));
+}
+
+template<class Key, class Comparator>
+typename PersistentAVLTree<Key, Comparator>::Node *PersistentAVLTree<Key, Comparator>::own(const Node *node) {
+    if (node->version == writeVersion) {
+        return const_cast<Node *>(node);
+    }
+    Node *copy = alloc.create(*node);
+    copy->version = writeVersion;
+    replaced.push_back(node);
+    return copy;
+}
+
+template<class Key, class Comparator>
+void PersistentAVLTree<Key, Comparator>::retire(const Node *node) {
+    if (node->version == writeVersion) {
+        alloc.destroy(const_cast<Node *>(node)); // узел не опубликован, его никто не видел
+    } else {
+        replaced.push_back(node);
+    }
+}
+
+template<class Key, class Comparator>
+void PersistentAVLTree<Key, Comparator>::publish(const Node *newRoot) {
+    root.store(newRoot);
+    std::uint64_t retiredEpoch = epoch.fetch_add(1);
+    for (const Node *node : replaced) {
+        retired.emplace_back(retiredEpoch, node);
+    }
+    replaced.clear();
+    reclaim();
+}
+
+template<class Key, class Comparator>
+void PersistentAVLTree<Key, Comparator>::reclaim() {
+    std::uint64_t oldestReader = epoch.load();
+    for (auto &readerEpoch : readerEpochs) {
+        std::uint64_t readerStart = readerEpoch.load();
+        if (readerStart != 0 && readerStart < oldestReader) {
+            oldestReader = readerStart;
+        }
+    }
+    while (!retired.empty() && retired.front().first < oldestReader) {
+        alloc.destroy(const_cast<Node *>(retired.front().second));
+        retired.pop_front();
+    }
+}
+
+template<class Key, class Comparator, size_t LeafSize, size_t Fanout>
+BPlusTree<Key, Comparator, LeafSize, Fanout>::~BPlusTree() {
+    if (std::is_trivially_destructible<Key>::value || !root) {
+        return; // узлы освободят пулы
+    }
+    _postOrder([this](Node *node, size_t level) {
+        if (level == 0) {
+            leaves.destroy(static_cast<Leaf *>(node));
+        } else {
+            inners.destroy(static_cast<Inner *>(node));
+        }
+    }, root, levels);
+}
+
+template<class Key, class Comparator, size_t LeafSize, size_t Fanout>
+size_t BPlusTree<Key, Comparator, LeafSize, Fanout>::insert(const Key &key) {
+    if (!root) {
+        root = leaves.create();
+    }
+    size_t greater = 0;
+    Key separator;
+    Node *right = _insert(root, levels, key, greater, separator);
+    if (right) { // корень разделился, дерево растет вверх
+        Inner *newRoot = inners.create();
+        newRoot->count = 2;
+        newRoot->children[0] = root;
+        newRoot->children[1] = right;
+        newRoot->sizes[0] = nodeSize(root, levels);
+        newRoot->sizes[1] = nodeSize(right, levels);
+        newRoot->separators[1] = separator;
+        root = newRoot;
+        levels++;
+    }
+    total++;
+    return greater;
+}
+
+template<class Key, class Comparator, size_t LeafSize, size_t Fanout>
+typename BPlusTree<Key, Comparator, LeafSize, Fanout>::Node *
+BPlusTree<Key, Comparator, LeafSize, Fanout>::_insert(Node *node, size_t level, const Key &key,
+                                                      size_t &greater, Key &separator) {
+    auto lessKey = [this](const Key &l, const Key &r) {
+        return less(l, r);
+    };
+    if (level == 0) {
+        Leaf *leaf = static_cast<Leaf *>(node);
+        Key *end = leaf->keys + leaf->count;
+        Key *pos = std::upper_bound(leaf->keys, end, key, lessKey); // равные ключи уходят вправо, как в AVLTree
+        greater += end - pos;
+        std::move_backward(pos, end, end + 1);
+        *pos = key;
+        if (++leaf->count < LeafSize) {
+            return nullptr;
+        }
+        Leaf *right = leaves.create();
+        size_t half = leaf->count / 2;
+        std::copy(leaf->keys + half, leaf->keys + leaf->count, right->keys);
+        right->count = leaf->count - half;
+        leaf->count = half;
+        separator = right->keys[0];
+        return right;
+    }
+
+    Inner *inner = static_cast<Inner *>(node);
+    size_t child = std::upper_bound(inner->separators + 1, inner->separators + inner->count, key, lessKey)
+                   - inner->separators - 1;
+    for (size_t i = child + 1; i < inner->count; i++) {
+        greater += inner->sizes[i];
+    }
+    inner->sizes[child]++;
+
+    Key childSeparator;
+    Node *right = _insert(inner->children[child], level - 1, key, greater, childSeparator);
+    if (!right) {
+        return nullptr;
+    }
+    std::uint32_t rightSize = nodeSize(right, level - 1);
+    inner->sizes[child] -= rightSize;
+    std::move_backward(inner->children + child + 1, inner->children + inner->count, inner->children + inner->count + 1);
+    std::move_backward(inner->sizes + child + 1, inner->sizes + inner->count, inner->sizes + inner->count + 1);
+    std::move_backward(inner->separators + child + 1, inner->separators + inner->count,
+                       inner->separators + inner->count + 1);
+    inner->children[child + 1] = right;
+    inner->sizes[child + 1] = rightSize;
+    inner->separators[child + 1] = childSeparator;
+    if (++inner->count < Fanout) {
+        return nullptr;
+    }
+
+    Inner *sibling = inners.create();
+    size_t half = inner->count / 2;
+    sibling->count = inner->count - half;
+    std::copy(inner->children + half, inner->children + inner->count, sibling->children);
+    std::copy(inner->sizes + half, inner->sizes + inner->count, sibling->sizes);
+    std::copy(inner->separators + half, inner->separators + inner->count, sibling->separators);
+    inner->count = half;
+    separator = sibling->separators[0];
+    return sibling;
+}
+
+template<class Key, class Comparator, size_t LeafSize, size_t Fanout>
+void BPlusTree<Key, Comparator, LeafSize, Fanout>::pop(size_t index) {
+    if (index >= total) {
+        return;
+    }
+    _pop(root, levels, total - 1 - index); // индекс считается со старших, позиция - с младших
+    total--;
+    if (levels > 0 && root->count == 1) {
+        Inner *oldRoot = static_cast<Inner *>(root);
+        root = oldRoot->children[0];
+        inners.destroy(oldRoot);
+        levels--;
+    }
+}
+
+template<class Key, class Comparator, size_t LeafSize, size_t Fanout>
+void BPlusTree<Key, Comparator, LeafSize, Fanout>::_pop(Node *node, size_t level, size_t pos) {
+    if (level == 0) {
+        Leaf *leaf = static_cast<Leaf *>(node);
+        std::move(leaf->keys + pos + 1, leaf->keys + leaf->count, leaf->keys + pos);
+        leaf->count--;
+        return;
+    }
+    Inner *inner = static_cast<Inner *>(node);
+    size_t child = childByPosition(inner->sizes, inner->count, pos);
+    inner->sizes[child]--;
+    _pop(inner->children[child], level - 1, pos);
+    if (inner->children[child]->count < capacity(level - 1) / 2) {
+        fixUnderflow(inner, child, level - 1);
+    }
+}
+
+template<class Key, class Comparator, size_t LeafSize, size_t Fanout>
+void BPlusTree<Key, Comparator, LeafSize, Fanout>::fixUnderflow(Inner *parent, size_t child, size_t level) {
+    size_t l = child + 1 < parent->count ? child : child - 1;
+    size_t r = l + 1;
+    Node *left = parent->children[l];
+    Node *right = parent->children[r];
+
+    if (left->count + right->count < capacity(level)) { // сливаем правого соседа в левого
+        if (level == 0) {
+            Leaf *leftLeaf = static_cast<Leaf *>(left);
+            Leaf *rightLeaf = static_cast<Leaf *>(right);
+            std::copy(rightLeaf->keys, rightLeaf->keys + rightLeaf->count, leftLeaf->keys + leftLeaf->count);
+        } else {
+            Inner *leftInner = static_cast<Inner *>(left);
+            Inner *rightInner = static_cast<Inner *>(right);
+            rightInner->separators[0] = parent->separators[r];
+            std::copy(rightInner->children, rightInner->children + rightInner->count,
+                      leftInner->children + leftInner->count);
+            std::copy(rightInner->sizes, rightInner->sizes + rightInner->count, leftInner->sizes + leftInner->count);
+            std::copy(rightInner->separators, rightInner->separators + rightInner->count,
+                      leftInner->separators + leftInner->count);
+        }
+        left->count += right->count;
+        if (level == 0) {
+            leaves.destroy(static_cast<Leaf *>(right));
+        } else {
+            inners.destroy(static_cast<Inner *>(right));
+        }
+        parent->sizes[l] += parent->sizes[r];
+        std::move(parent->children + r + 1, parent->children + parent->count, parent->children + r);
+        std::move(parent->sizes + r + 1, parent->sizes + parent->count, parent->sizes + r);
+        std::move(parent->separators + r + 1, parent->separators + parent->count, parent->separators + r);
+        parent->count--;
+        return;
+    }
+
+    // сосед достаточно полон, забираем у него один элемент
+    std::uint32_t moved = 1;
+    if (level == 0) {
+        Leaf *leftLeaf = static_cast<Leaf *>(left);
+        Leaf *rightLeaf = static_cast<Leaf *>(right);
+        if (child == l) {
+            leftLeaf->keys[leftLeaf->count] = rightLeaf->keys[0];
+            std::move(rightLeaf->keys + 1, rightLeaf->keys + rightLeaf->count, rightLeaf->keys);
+        } else {
+            std::move_backward(rightLeaf->keys, rightLeaf->keys + rightLeaf->count,
+                               rightLeaf->keys + rightLeaf->count + 1);
+            rightLeaf->keys[0] = leftLeaf->keys[leftLeaf->count - 1];
+        }
+        parent->separators[r] = rightLeaf->keys[0];
+    } else {
+        Inner *leftInner = static_cast<Inner *>(left);
+        Inner *rightInner = static_cast<Inner *>(right);
+        if (child == l) {
+            size_t last = leftInner->count;
+            leftInner->children[last] = rightInner->children[0];
+            leftInner->sizes[last] = rightInner->sizes[0];
+            leftInner->separators[last] = parent->separators[r];
+            parent->separators[r] = rightInner->separators[1];
+            moved = rightInner->sizes[0];
+            std::move(rightInner->children + 1, rightInner->children + rightInner->count, rightInner->children);
+            std::move(rightInner->sizes + 1, rightInner->sizes + rightInner->count, rightInner->sizes);
+            std::move(rightInner->separators + 1, rightInner->separators + rightInner->count, rightInner->separators);
+        } else {
+            size_t last = leftInner->count - 1;
+            std::move_backward(rightInner->children, rightInner->children + rightInner->count,
+                               rightInner->children + rightInner->count + 1);
+            std::move_backward(rightInner->sizes, rightInner->sizes + rightInner->count,
+                               rightInner->sizes + rightInner->count + 1);
+            std::move_backward(rightInner->separators, rightInner->separators + rightInner->count,
+                               rightInner->separators + rightInner->count + 1);
+            rightInner->children[0] = leftInner->children[last];
+            rightInner->sizes[0] = leftInner->sizes[last];
+            rightInner->separators[1] = parent->separators[r];
+            parent->separators[r] = leftInner->separators[last];
+            moved = leftInner->sizes[last];
+        }
+    }
+    if (child == l) {
+        left->count++;
+        right->count--;
+        parent->sizes[l] += moved;
+        parent->sizes[r] -= moved;
+    } else {
+        left->count--;
+        right->count++;
+        parent->sizes[l] -= moved;
+        parent->sizes[r] += moved;
+    }
+}
+
+template<class Key, class Comparator, size_t LeafSize, size_t Fanout>
+size_t BPlusTree<Key, Comparator, LeafSize, Fanout>::childByPosition(const std::uint32_t *sizes,
+                                                                     [[maybe_unused]] size_t count, size_t &pos) {
+    size_t i = 0;
+    // по умолчанию собирается скалярный цикл; блоки по 8 включаются опцией TASK4_AVX2 в CMake
+#ifdef __AVX2__
+    // пропускаем детей блоками по 8: сумма блока считается в регистре
+    for (; i + 8 <= count; i += 8) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sizes + i));
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(block), _mm256_extracti128_si256(block, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+        size_t blockSize = static_cast<std::uint32_t>(_mm_cvtsi128_si32(sum));
+        if (pos < blockSize) {
+            break;
+        }
+        pos -= blockSize;
+    }
+#endif
+    for (; pos >= sizes[i]; i++) {
+        pos -= sizes[i];
+    }
+    return i;
+}
+
+template<class Key, class Comparator, size_t LeafSize, size_t Fanout>
+size_t BPlusTree<Key, Comparator, LeafSize, Fanout>::nodeSize(Node *node, size_t level) const {
+    if (level == 0) {
+        return node->count;
+    }
+    Inner *inner = static_cast<Inner *>(node);
+    size_t sum = 0;
+    for (size_t i = 0; i < inner->count; i++) {
+        sum += inner->sizes[i];
+    }
+    return sum;
+}
+
+template<class Key, class Comparator, size_t LeafSize, size_t Fanout>
+void BPlusTree<Key, Comparator, LeafSize, Fanout>::_print(Node *node, size_t level) {
+    if (!node) {
+        return;
+    }
+    for (size_t i = node->count; i > 0; i--) {
+        if (level == 0) {
+            std::cout << static_cast<Leaf *>(node)->keys[i - 1] << std::endl;
+        } else {
+            _print(static_cast<Inner *>(node)->children[i - 1], level - 1);
+        }
+    }
+}
+
+template<class Key, class Comparator, size_t LeafSize, size_t Fanout>
+template<class Action>
+void BPlusTree<Key, Comparator, LeafSize, Fanout>::_postOrder(Action action, Node *node, size_t level) {
+    if (level > 0) {
+        Inner *inner = static_cast<Inner *>(node);
+        for (size_t i = 0; i < inner->count; i++) {
+            _postOrder(action, inner->children[i], level - 1);
+        }
+    }
+    action(node, level);
+}
+
+template<class Tree>
+void test(Tree &tree) {
     int count;
     std::cin >> count;
     for (int i = 0; i < count; i++) {
@@ -303,3 +1490,47 @@ void test(AVLTree<int> &tree) {
     }
     tree.print();
 }
+
+void testOffline() {
+    int count;
+    std::cin >> count;
+    std::vector<std::pair<int, int>> commands(count);
+    std::vector<int> keys;
+    for (auto &command : commands) {
+        std::cin >> command.first >> command.second;
+        if (command.first == 1) {
+            keys.push_back(command.second);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    // ключи сжаты до позиций в keys: дерево Фенвика считает индексы, copies - копии ключа
+    FenwickTree counts(keys.size());
+    std::vector<std::uint32_t> copies(keys.size(), 0);
+    for (auto &command : commands) {
+        switch (command.first) {
+            case 1: {
+                size_t pos = std::lower_bound(keys.begin(), keys.end(), command.second) - keys.begin();
+                std::cout << counts.size() - counts.prefix(pos) << '\n'; // сколько ключей строго больше
+                counts.add(pos, 1);
+                copies[pos]++;
+                break;
+            }
+            case 2: {
+                size_t index = command.second;
+                if (index < counts.size()) {
+                    size_t pos = counts.findByOrder(counts.size() - 1 - index);
+                    counts.add(pos, -1);
+                    copies[pos]--;
+                }
+                break;
+            }
+        }
+    }
+    for (size_t pos = keys.size(); pos > 0; pos--) {
+        for (std::uint32_t i = 0; i < copies[pos - 1]; i++) {
+            std::cout << keys[pos - 1] << '\n';
+        }
+    }
+}
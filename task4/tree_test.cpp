@@ -0,0 +1,272 @@
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <string>
+#define TASK4_NO_MAIN
+#include "main.cpp"
+
+// Проверки деревьев task4 по эталону из стандартной библиотеки.
+// Любое расхождение печатается, код возврата - есть ли ошибки
+
+std::atomic<int> failures(0);
+
+void check(bool ok, const std::string &what) {
+    if (!ok) {
+        failures++;
+        std::cerr << "FAIL " << what << std::endl;
+    }
+}
+
+// ключи дерева по индексам совпадают с эталоном, а высота в пределах AVL-оценки
+template<class Tree>
+bool sameKeys(const Tree &tree, const std::multiset<int> &reference) {
+    if (tree.size() != reference.size() || tree.height() > 1.45 * std::log2(reference.size() + 2)) {
+        return false;
+    }
+    size_t index = 0;
+    for (auto key = reference.rbegin(); key != reference.rend(); ++key, ++index) {
+        if (tree.select(index) != *key) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// удаление по индексу из эталона: индексы считаются со старшего ключа
+void popReference(std::multiset<int> &reference, size_t index) {
+    auto key = reference.end();
+    std::advance(key, -static_cast<std::ptrdiff_t>(index + 1));
+    reference.erase(key);
+}
+
+// Запросы по индексам и рангам против std::multiset: ключей мало, поэтому много повторов.
+// В режиме множества равные ключи лежат в разных узлах, и find находит любую из копий
+template<bool Multiset>
+void testQueries(const std::string &mode) {
+    using Tree = AVLTree<int, DefaultComparator<int>, NodePool, Multiset>;
+    std::mt19937 rng(21);
+    Tree tree;
+    std::multiset<int> reference;
+    auto greater = [&reference](int key) {
+        return static_cast<size_t>(std::distance(reference.upper_bound(key), reference.end()));
+    };
+    for (int step = 0; step < 6000; step++) {
+        if (reference.empty() || rng() % 3 != 0) {
+            int key = static_cast<int>(rng() % 300);
+            check(tree.insert(key) == greater(key), mode + " insert index of " + std::to_string(key));
+            reference.insert(key);
+        } else {
+            size_t index = rng() % reference.size();
+            tree.pop(index);
+            popReference(reference, index);
+        }
+        if (step % 100 != 0) {
+            continue;
+        }
+        std::string name = mode + " step " + std::to_string(step);
+        check(sameKeys(tree, reference), "select " + name);
+        std::vector<int> keys;
+        for (int key = -1; key <= 300; key += 1 + static_cast<int>(rng() % 7)) {
+            keys.push_back(key);
+            size_t copies = reference.count(key);
+            size_t less = std::distance(reference.begin(), reference.lower_bound(key));
+            size_t notGreater = std::distance(reference.begin(), reference.upper_bound(key));
+            size_t found = tree.find(key);
+            bool foundOk = copies == 0 ? found == Tree::npos
+                                       : Multiset ? found == greater(key)
+                                                  : found >= greater(key) && found < greater(key) + copies;
+            int to = key + static_cast<int>(rng() % 40) - 10;
+            size_t inRange = to < key ? 0 : std::distance(reference.begin(), reference.upper_bound(to)) - less;
+            check(foundOk && tree.rank(key) == greater(key) && tree.lowerBound(key) == less
+                  && tree.upperBound(key) == notGreater && tree.countInRange(key, to) == inRange,
+                  "queries for " + std::to_string(key) + " " + name);
+        }
+        std::vector<size_t> ranks;
+        tree.rank(keys, ranks);
+        bool ranksOk = ranks.size() == keys.size();
+        for (size_t i = 0; ranksOk && i < keys.size(); i++) {
+            ranksOk = ranks[i] == greater(keys[i]);
+        }
+        check(ranksOk, "batch rank " + name);
+    }
+}
+
+// insertBatch против вставки по одному: те же ключи и индексы, в одном потоке и в нескольких.
+// Набор от parallelBatch ключей при threads > 1 сливается в нескольких потоках и на одном ядре
+template<bool Multiset>
+void testInsertBatch(const std::string &mode) {
+    std::mt19937 rng(13);
+    for (unsigned threads : {1u, 4u}) {
+        AVLTree<int, DefaultComparator<int>, NodePool, Multiset> tree, single;
+        std::multiset<int> reference;
+        std::string name = mode + " threads " + std::to_string(threads);
+        for (size_t size : {100, 40000, 0, 3}) {
+            std::vector<int> batch(size);
+            for (auto &key : batch) {
+                key = static_cast<int>(rng() % 30000);
+            }
+            std::sort(batch.begin(), batch.end());
+            std::vector<size_t> indices, expected;
+            for (int key : batch) {
+                expected.push_back(single.insert(key));
+                reference.insert(key);
+            }
+            tree.insertBatch(batch, indices, threads);
+            check(indices == expected, "batch indices " + name + " size " + std::to_string(size));
+            check(sameKeys(tree, reference), "batch keys " + name + " size " + std::to_string(size));
+        }
+        // после слияния дерево остается рабочим
+        for (int round = 0; round < 300; round++) {
+            size_t index = rng() % tree.size();
+            tree.pop(index);
+            popReference(reference, index);
+        }
+        check(sameKeys(tree, reference), "pop after batch " + name);
+    }
+}
+
+// слотов читателей ровно maxReaders: следующий снимок недействителен, пока какой-то не освободится
+void testSnapshotSlots() {
+    using Tree = PersistentAVLTree<int>;
+    Tree tree;
+    tree.insert(1);
+    std::vector<Tree::Snapshot> snapshots;
+    for (size_t i = 0; i < Tree::maxReaders; i++) {
+        snapshots.push_back(tree.snapshot());
+        check(snapshots.back().valid() && snapshots.back().size() == 1, "snapshot " + std::to_string(i));
+    }
+    Tree::Snapshot extra = tree.snapshot();
+    check(!extra.valid() && extra.size() == 0, "snapshot without free slot is invalid");
+    snapshots.pop_back();
+    extra = tree.snapshot();
+    check(extra.valid() && extra.size() == 1, "snapshot after a slot is released");
+}
+
+// Писатель вставляет ключи в порядке inserted, затем удаляет в порядке popped, а читатели
+// параллельно берут снимки. Содержимое снимка определяется его размером и фазой записи:
+// size ключей начала inserted или все, кроме начала popped
+struct SnapshotReference {
+    std::vector<size_t> insertedAt; // позиция ключа в порядке вставки, по ключу / 2
+    std::vector<size_t> poppedAt;
+    std::atomic<int> phase; // 0 - вставки, 1 - удаления, 2 - запись закончена
+
+    bool present(int key, size_t size, int snapshotPhase) const {
+        if (key < 0 || key % 2 != 0 || static_cast<size_t>(key / 2) >= insertedAt.size()) {
+            return false;
+        }
+        size_t total = insertedAt.size();
+        return snapshotPhase == 0 ? insertedAt[key / 2] < size : poppedAt[key / 2] >= total - size;
+    }
+};
+
+void checkSnapshot(const PersistentAVLTree<int>::Snapshot &snapshot, const SnapshotReference &reference,
+                   int snapshotPhase, std::mt19937 &rng) {
+    size_t size = snapshot.size();
+    // size разных ключей, все из эталона того же размера - значит, множества совпадают
+    std::vector<int> keys(size);
+    bool same = true;
+    for (size_t i = 0; i < size; i++) {
+        keys[i] = snapshot.select(i);
+        same = same && reference.present(keys[i], size, snapshotPhase) && (i == 0 || keys[i] < keys[i - 1]);
+    }
+    check(same, "snapshot of size " + std::to_string(size) + " matches the reference");
+    if (!same) {
+        return;
+    }
+    std::reverse(keys.begin(), keys.end());
+    int range = static_cast<int>(reference.insertedAt.size() * 2);
+    for (int round = 0; round < 20; round++) {
+        int key = static_cast<int>(rng() % (range + 2)) - 1;
+        int to = key + static_cast<int>(rng() % 50);
+        size_t less = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        size_t notGreater = std::upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+        size_t found = less < notGreater ? size - notGreater : PersistentAVLTree<int>::npos;
+        size_t inRange = std::upper_bound(keys.begin(), keys.end(), to) - keys.begin() - less;
+        check(snapshot.find(key) == found && snapshot.rank(key) == size - notGreater
+              && snapshot.lowerBound(key) == less && snapshot.upperBound(key) == notGreater
+              && snapshot.countInRange(key, to) == inRange,
+              "snapshot queries for key " + std::to_string(key));
+    }
+}
+
+void testConcurrentSnapshots() {
+    const size_t count = 5000;
+    const size_t readers = 4;
+    std::mt19937 rng(7);
+    std::vector<int> inserted(count), popped(count);
+    for (size_t i = 0; i < count; i++) {
+        inserted[i] = popped[i] = static_cast<int>(2 * i);
+    }
+    std::shuffle(inserted.begin(), inserted.end(), rng);
+    std::shuffle(popped.begin(), popped.end(), rng);
+    SnapshotReference reference;
+    reference.insertedAt.resize(count);
+    reference.poppedAt.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        reference.insertedAt[inserted[i] / 2] = i;
+        reference.poppedAt[popped[i] / 2] = i;
+    }
+    reference.phase = 0;
+
+    PersistentAVLTree<int> tree;
+    std::atomic<size_t> checked(0);
+    std::vector<std::future<void>> tasks;
+    for (size_t reader = 0; reader < readers; reader++) {
+        tasks.push_back(std::async(std::launch::async, [&tree, &reference, &checked, reader]() {
+            std::mt19937 readerRng(static_cast<unsigned>(reader));
+            while (reference.phase.load() != 2) {
+                // фаза читается до и после снимка: если она не сменилась, снимок взят в этой фазе
+                int before = reference.phase.load();
+                auto snapshot = tree.snapshot();
+                if (!snapshot.valid() || reference.phase.load() != before || before == 2) {
+                    continue;
+                }
+                checkSnapshot(snapshot, reference, before, readerRng);
+                checked++;
+            }
+        }));
+    }
+
+    // ответы insert сверяются с std::set на стороне писателя
+    std::set<int> keys;
+    for (size_t i = 0; i < count; i++) {
+        size_t expected = std::distance(keys.upper_bound(inserted[i]), keys.end());
+        keys.insert(inserted[i]);
+        check(tree.insert(inserted[i]) == expected, "insert index of " + std::to_string(inserted[i]));
+        if (i % 64 == 0) {
+            std::this_thread::yield();
+        }
+    }
+    reference.phase = 1;
+    for (size_t i = 0; i < count; i++) {
+        size_t index = tree.snapshot().find(popped[i]);
+        check(index != PersistentAVLTree<int>::npos, "popped key is present");
+        tree.pop(index);
+        if (i % 64 == 0) {
+            std::this_thread::yield();
+        }
+    }
+    // на одном ядре читатели могли еще не успеть: ждем хотя бы одну проверку
+    while (checked.load() == 0) {
+        std::this_thread::yield();
+    }
+    reference.phase = 2;
+    for (auto &task : tasks) {
+        task.get();
+    }
+    check(tree.size() == 0, "all keys are popped");
+}
+
+int main() {
+    testQueries<false>("set");
+    testQueries<true>("multiset");
+    testInsertBatch<false>("set");
+    testInsertBatch<true>("multiset");
+    testSnapshotSlots();
+    testConcurrentSnapshots();
+    if (failures == 0) {
+        std::cout << "tree tests OK" << std::endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
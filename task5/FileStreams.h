@@ -0,0 +1,167 @@
+#ifndef _FILE_STREAMS_H
+#define _FILE_STREAMS_H
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Huffman.h"
+
+// Файл целиком отображается в память только для чтения: байты берутся прямо из страниц
+// файла, без read и без копии в std::vector
+class MappedFileInput : public IInputStream {
+public:
+    using IInputStream::Read;
+
+    explicit MappedFileInput(const char *path) : data(nullptr), size(0), pos(0), opened(false) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            // пустой файл отобразить нельзя, но читать из него можно
+            opened = info.st_size == 0;
+            if (info.st_size > 0) {
+                void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    data = static_cast<const byte *>(mapped);
+                    size = info.st_size;
+                    opened = true;
+                    madvise(mapped, size, MADV_SEQUENTIAL);
+                }
+            }
+        }
+        close(fd);
+    }
+
+    MappedFileInput(const MappedFileInput &) = delete;
+
+    MappedFileInput &operator=(const MappedFileInput &) = delete;
+
+    ~MappedFileInput() {
+        if (data) {
+            munmap(const_cast<byte *>(data), size);
+        }
+    }
+
+    bool isOpen() const {
+        return opened;
+    }
+
+    size_t fileSize() const {
+        return size;
+    }
+
+    // содержимое файла целиком, например для DecodeRange
+    const byte *mapped() const {
+        return data;
+    }
+
+    bool Read(byte &value) {
+        if (pos >= size) {
+            return false;
+        }
+        value = data[pos++];
+        return true;
+    }
+
+    size_t Read(byte *dst, size_t count) {
+        count = std::min(count, size - pos);
+        if (count == 0) {
+            return 0;
+        }
+        std::memcpy(dst, data + pos, count);
+        pos += count;
+        return count;
+    }
+
+private:
+    const byte *data;
+    size_t size;
+    size_t pos;
+    bool opened;
+};
+
+// Запись в файл большими кусками через write
+class BufferedFileOutput : public IOutputStream {
+public:
+    using IOutputStream::Write;
+
+    explicit BufferedFileOutput(const char *path, size_t bufferSize = 1 << 20)
+            : fd(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)), written(0), failed(fd < 0) {
+        buffer.reserve(bufferSize);
+    }
+
+    BufferedFileOutput(const BufferedFileOutput &) = delete;
+
+    BufferedFileOutput &operator=(const BufferedFileOutput &) = delete;
+
+    ~BufferedFileOutput() {
+        flush();
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    // false, если какая-то запись не удалась
+    bool good() const {
+        return !failed;
+    }
+
+    size_t bytesWritten() const {
+        return written + buffer.size();
+    }
+
+    void Write(byte &value) {
+        if (buffer.size() == buffer.capacity()) {
+            flush();
+        }
+        buffer.push_back(value);
+    }
+
+    void Write(const byte *src, size_t count) {
+        if (buffer.size() + count > buffer.capacity()) {
+            flush();
+        }
+        if (count >= buffer.capacity()) {
+            writeAll(src, count);
+            return;
+        }
+        buffer.insert(buffer.end(), src, src + count);
+    }
+
+    void flush() {
+        writeAll(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+private:
+    // в written попадают только байты, которые приняла система
+    void writeAll(const byte *src, size_t count) {
+        while (count > 0 && !failed) {
+            ssize_t done = write(fd, src, count);
+            if (done <= 0) {
+                failed = true;
+                break;
+            }
+            src += done;
+            count -= done;
+            written += done;
+        }
+    }
+
+    int fd;
+    size_t written;
+    bool failed;
+    std::vector<byte> buffer;
+};
+
+#endif //_FILE_STREAMS_H
@@ -1,14 +1,35 @@
 #ifndef _HUFFMAN_H
 #define _HUFFMAN_H
 
+#include <cstddef>
+
 typedef unsigned char byte;
 
+// Наследники, переопределяющие только побайтовый Read или Write, должны подключать
+// второй вариант через using IInputStream::Read / using IOutputStream::Write, иначе он скрывается
+
 struct IInputStream {
     virtual bool Read(byte &value) = 0;
+
+    // читает до count байт в dst, возвращает сколько прочитано; 0 - поток закончился
+    virtual size_t Read(byte *dst, size_t count) {
+        size_t done = 0;
+        while (done < count && Read(dst[done])) {
+            done++;
+        }
+        return done;
+    }
 };
 
 struct IOutputStream {
     virtual void Write(byte &value) = 0;
+
+    virtual void Write(const byte *src, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            byte value = src[i];
+            Write(value);
+        }
+    }
 };
 
 #endif //_HUFFMAN_H
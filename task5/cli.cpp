@@ -0,0 +1,97 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include "toContest.cpp"
+#include "FileStreams.h"
+
+const long maxThreads = 256;
+// блок больше DecodeOptions::maxBlockSize декодер отвергнет
+const long maxBlockKB = static_cast<long>(DecodeOptions().maxBlockSize >> 10);
+
+int usage(const char *program) {
+    std::cerr << "usage: " << program << " -c|-d input output [-j threads] [-b blockKB]" << std::endl;
+    std::cerr << "  threads: 1.." << maxThreads << ", blockKB: 1.." << maxBlockKB << std::endl;
+    return 1;
+}
+
+// целое число от 1 до max без лишних символов, иначе 0
+long parsePositive(const char *text, long max) {
+    errno = 0;
+    char *end = nullptr;
+    long value = std::strtol(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || value <= 0 || value > max) {
+        return 0;
+    }
+    return value;
+}
+
+// task5_cli -c|-d input output [-j threads] [-b blockKB]
+// сжимает или распаковывает файл и печатает размеры, степень сжатия и скорость
+int main(int argc, char **argv) {
+    if (argc < 4 || (std::string(argv[1]) != "-c" && std::string(argv[1]) != "-d") || argc % 2 != 0) {
+        return usage(argv[0]);
+    }
+    bool compress = std::string(argv[1]) == "-c";
+    EncodeOptions encodeOptions;
+    DecodeOptions decodeOptions;
+    for (int i = 4; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        if (flag == "-j") {
+            long threads = parsePositive(argv[i + 1], maxThreads);
+            if (threads == 0) {
+                std::cerr << "bad thread count " << argv[i + 1] << std::endl;
+                return usage(argv[0]);
+            }
+            encodeOptions.threads = decodeOptions.threads = static_cast<unsigned>(threads);
+        } else if (flag == "-b") {
+            long blockKB = parsePositive(argv[i + 1], maxBlockKB);
+            if (blockKB == 0) {
+                std::cerr << "bad block size " << argv[i + 1] << std::endl;
+                return usage(argv[0]);
+            }
+            encodeOptions.blockSize = static_cast<size_t>(blockKB) << 10;
+        } else {
+            std::cerr << "unknown option " << flag << std::endl;
+            return usage(argv[0]);
+        }
+    }
+
+    MappedFileInput input(argv[2]);
+    if (!input.isOpen()) {
+        std::cerr << "cannot open " << argv[2] << std::endl;
+        return 1;
+    }
+    BufferedFileOutput output(argv[3]);
+    if (!output.isOpen()) {
+        std::cerr << "cannot create " << argv[3] << std::endl;
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool decoded = true;
+    if (compress) {
+        Encode(input, output, encodeOptions);
+    } else {
+        decoded = Decode(input, output, decodeOptions);
+    }
+    output.flush();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!output.good()) {
+        std::cerr << "write to " << argv[3] << " failed" << std::endl;
+        return 1;
+    }
+    // текст до испорченного места уже записан, но целым он не считается
+    if (!decoded) {
+        std::cerr << argv[2] << " is truncated or corrupt, " << output.bytesWritten() << " bytes decoded" << std::endl;
+        return 1;
+    }
+
+    // скорость считаем по несжатому размеру, степень сжатия - как в task5/statistic
+    size_t original = compress ? input.fileSize() : output.bytesWritten();
+    size_t compressed = compress ? output.bytesWritten() : input.fileSize();
+    std::cout << original << " : " << (original ? static_cast<double>(compressed) / original : 0) << std::endl;
+    std::cout << (compress ? "encode " : "decode ") << seconds << " s, "
+              << (seconds > 0 ? original / seconds / 1e6 : 0) << " MB/s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,487 @@
+#include <cstdlib>
+#include <random>
+#include <string>
+#include "toContest.cpp"
+
+// Проверки кодека: круговое кодирование во всех режимах и разбор испорченных потоков.
+// Любое расхождение печатается, код возврата - число ошибок
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+    if (!ok) {
+        failures++;
+        std::cerr << "FAIL " << what << std::endl;
+    }
+}
+
+std::vector<byte> encode(const std::vector<byte> &text, const EncodeOptions &options) {
+    std::vector<byte> source = text;
+    std::vector<byte> compressed;
+    VectorInput input(&source);
+    VectorOutput output(&compressed);
+    Encode(input, output, options);
+    return compressed;
+}
+
+// false, если Decode счел поток испорченным
+bool decodeTo(const std::vector<byte> &compressed, std::vector<byte> &text,
+              const DecodeOptions &options = DecodeOptions()) {
+    std::vector<byte> source = compressed;
+    VectorInput input(&source);
+    VectorOutput output(&text);
+    return Decode(input, output, options);
+}
+
+std::vector<byte> decode(const std::vector<byte> &compressed, const DecodeOptions &options = DecodeOptions()) {
+    std::vector<byte> text;
+    decodeTo(compressed, text, options);
+    return text;
+}
+
+// конец блока endBlock в потоке с рамкой: обрезка до него - неполный поток
+size_t framedEnd(const std::vector<byte> &compressed) {
+    auto blocks = blockIndex(compressed.data(), compressed.size());
+    if (compressed.empty() || compressed[0] != framed || blocks.empty()) {
+        return 0;
+    }
+    bool ok = true;
+    size_t pos = blocks.back().first + 1;
+    parseVarint(compressed.data(), compressed.size(), pos, ok);
+    size_t payloadSize = parseVarint(compressed.data(), compressed.size(), pos, ok);
+    return pos + payloadSize + 1;
+}
+
+// набор текстов: пустой, короткие, повторяющиеся, похожие на текст, случайные и с длинными сериями
+std::vector<std::pair<std::string, std::vector<byte>>> samples() {
+    std::mt19937 rng(17);
+    std::vector<std::pair<std::string, std::vector<byte>>> texts;
+    for (size_t size : {0, 1, 7, 8, 31, 100, 4096, 70000}) {
+        std::vector<byte> repeated(size);
+        std::vector<byte> words(size);
+        std::vector<byte> random(size);
+        for (size_t i = 0; i < size; i++) {
+            repeated[i] = "abcab"[i % 5];
+            words[i] = rng() % 7 == 0 ? ' ' : static_cast<byte>('a' + rng() % 12);
+            random[i] = static_cast<byte>(rng());
+        }
+        texts.push_back({"repeated " + std::to_string(size), repeated});
+        texts.push_back({"text " + std::to_string(size), words});
+        texts.push_back({"random " + std::to_string(size), random});
+        texts.push_back({"zeros " + std::to_string(size), std::vector<byte>(size, 0)});
+    }
+    std::vector<byte> all;
+    for (int round = 0; round < 3; round++) {
+        for (int symbol = 0; symbol < 256; symbol++) {
+            all.push_back(static_cast<byte>(symbol));
+        }
+    }
+    texts.push_back({"all bytes", all});
+    // частоты Фибоначчи дают коды длиннее 11 бит до ограничения длины
+    std::vector<byte> fibonacci;
+    size_t previous = 1, current = 1;
+    for (int symbol = 0; symbol < 24; symbol++) {
+        fibonacci.insert(fibonacci.end(), current, static_cast<byte>(symbol));
+        size_t next = previous + current;
+        previous = current;
+        current = next;
+    }
+    texts.push_back({"fibonacci", fibonacci});
+    return texts;
+}
+
+std::vector<byte> sample(const std::string &name) {
+    for (auto &text : samples()) {
+        if (text.first == name) {
+            return text.second;
+        }
+    }
+    return {};
+}
+
+std::vector<EncodeOptions> optionSets() {
+    std::vector<EncodeOptions> sets(5);
+    sets[1].blockSize = 1 << 12;
+    sets[2].blockSize = 1 << 12;
+    sets[2].interleave = false;
+    sets[3].blockSize = 1000;
+    sets[3].threads = 4;
+    sets[3].maxCodeLength = 20;
+    sets[4].maxCodeLength = 32;
+    sets[4].interleave = false;
+    return sets;
+}
+
+void testRoundTrip() {
+    auto sets = optionSets();
+    for (auto &sample : samples()) {
+        for (size_t set = 0; set < sets.size(); set++) {
+            std::vector<byte> compressed = encode(sample.second, sets[set]);
+            std::string name = sample.first + " options " + std::to_string(set);
+            std::vector<byte> text;
+            check(decodeTo(compressed, text) && text == sample.second, "round trip " + name);
+            DecodeOptions parallel;
+            parallel.threads = 3;
+            check(decode(compressed, parallel) == sample.second, "parallel decode " + name);
+        }
+    }
+}
+
+// потеря от ограничения длины кода доходит до вызывающего через stats
+void testLimitLoss() {
+    // перемешанный, чтобы блоки не ушли в серии
+    std::vector<byte> fibonacci = samples().back().second;
+    std::shuffle(fibonacci.begin(), fibonacci.end(), std::mt19937(11));
+    for (size_t blockSize : {size_t(1) << 18, size_t(1) << 12}) {
+        EncodeStats limited, unlimited;
+        EncodeOptions options;
+        options.blockSize = blockSize;
+        options.stats = &limited;
+        encode(fibonacci, options);
+        options.maxCodeLength = 32;
+        options.stats = &unlimited;
+        encode(fibonacci, options);
+        check(limited.limitLossBits > 0, "limit loss is reported for block " + std::to_string(blockSize));
+        check(unlimited.limitLossBits == 0, "no limit loss without limit for block " + std::to_string(blockSize));
+        EncodeStats span;
+        options.maxCodeLength = HuffmanTree::defaultMaxCodeLength;
+        options.stats = &span;
+        std::vector<byte> compressed(compressBound(fibonacci.size(), blockSize));
+        Encode(fibonacci.data(), fibonacci.size(), compressed.data(), compressed.size(), options);
+        check(span.limitLossBits == limited.limitLossBits,
+              "span encode reports the same loss for block " + std::to_string(blockSize));
+    }
+}
+
+// длины кодов в заголовке canonical и в блоках fourStreams
+void testCanonicalHeader() {
+    for (auto &sample : samples()) {
+        if (sample.second.size() < 8) {
+            continue;
+        }
+        HuffmanTree tree(sample.second.data(), sample.second.size());
+        std::vector<byte> header;
+        VectorOutput headerStream(&header);
+        BitOutputStream bits(headerStream);
+        tree.lengthsWrite(bits);
+        bits.flush();
+        VectorInput headerInput(&header);
+        BitInputStream readBits(headerInput);
+        HuffmanTree restored;
+        check(restored.lengthsRead(readBits), "lengths read " + sample.first);
+        bool same = true;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            same = same && restored.codeMap[symbol].size == tree.codeMap[symbol].size
+                   && restored.codeMap[symbol].code == tree.codeMap[symbol].code;
+        }
+        check(same, "lengths header " + sample.first);
+    }
+}
+
+void testDecodeRange() {
+    std::mt19937 rng(5);
+    EncodeOptions options;
+    options.blockSize = 1 << 12;
+    for (auto &sample : samples()) {
+        const std::vector<byte> &text = sample.second;
+        std::vector<byte> compressed = encode(text, options);
+        // без индекса блоки находятся по заголовкам
+        std::vector<byte> withoutIndex = compressed;
+        if (size_t end = framedEnd(compressed)) {
+            withoutIndex.resize(end);
+        }
+        for (int round = 0; round < 20; round++) {
+            size_t offset = rng() % (text.size() + 10);
+            size_t length = rng() % 10000;
+            std::vector<byte> expected(text.begin() + std::min(offset, text.size()),
+                                       text.begin() + std::min(text.size(), offset + length));
+            for (auto *stream : {&compressed, &withoutIndex}) {
+                std::vector<byte> slice;
+                VectorOutput output(&slice);
+                DecodeRange(stream->data(), stream->size(), offset, length, output);
+                check(slice == expected, "range " + sample.first + " at " + std::to_string(offset));
+            }
+        }
+        // length = SIZE_MAX - до конца текста
+        size_t offset = text.size() / 3;
+        std::vector<byte> tail(text.begin() + offset, text.end());
+        for (auto *stream : {&compressed, &withoutIndex}) {
+            std::vector<byte> slice;
+            VectorOutput output(&slice);
+            DecodeRange(stream->data(), stream->size(), offset, SIZE_MAX, output);
+            check(slice == tail, "range to the end " + sample.first);
+        }
+    }
+}
+
+// поток подается кусками от одного байта, текст забирается кусками случайной длины
+std::vector<byte> decodePushed(const std::vector<byte> &compressed, std::mt19937 &rng, size_t maxChunk,
+                               bool &failed, const DecodeOptions &options = DecodeOptions()) {
+    HuffmanDecoder decoder(options);
+    std::vector<byte> text;
+    std::array<byte, 777> buffer;
+    size_t pos = 0;
+    while (pos < compressed.size() && !decoder.failed()) {
+        size_t chunk = std::min(compressed.size() - pos, 1 + rng() % maxChunk);
+        pos += decoder.feed(compressed.data() + pos, chunk);
+        while (size_t got = decoder.read(buffer.data(), 1 + rng() % buffer.size())) {
+            text.insert(text.end(), buffer.begin(), buffer.begin() + got);
+        }
+    }
+    decoder.finish();
+    while (size_t got = decoder.read(buffer.data(), buffer.size())) {
+        text.insert(text.end(), buffer.begin(), buffer.begin() + got);
+    }
+    failed = decoder.failed() || !decoder.done();
+    return text;
+}
+
+void testPushDecoder() {
+    std::mt19937 rng(9);
+    auto sets = optionSets();
+    for (auto &sample : samples()) {
+        for (size_t set = 0; set < sets.size(); set++) {
+            std::vector<byte> compressed = encode(sample.second, sets[set]);
+            for (size_t maxChunk : {1, 100, 5000}) {
+                bool failed = false;
+                std::vector<byte> text = decodePushed(compressed, rng, maxChunk, failed);
+                check(!failed && text == sample.second,
+                      "push decoder " + sample.first + " options " + std::to_string(set));
+            }
+        }
+    }
+}
+
+void testSpans() {
+    auto sets = optionSets();
+    for (auto &sample : samples()) {
+        const std::vector<byte> &text = sample.second;
+        for (size_t set = 0; set < sets.size(); set++) {
+            std::string name = sample.first + " options " + std::to_string(set);
+            std::vector<byte> compressed(compressBound(text.size(), sets[set].blockSize));
+            size_t size = Encode(text.data(), text.size(), compressed.data(), compressed.size(), sets[set]);
+            check(size != SIZE_MAX, "span encode fits bound " + name);
+            if (size == SIZE_MAX) {
+                continue;
+            }
+            // тот же поток, что у Encode по потокам с теми же настройками
+            std::vector<byte> expected = encode(text, sets[set]);
+            check(std::equal(expected.begin(), expected.end(), compressed.begin(), compressed.begin() + size)
+                  && expected.size() == size, "span encode matches stream encode " + name);
+            std::vector<byte> restored(text.size());
+            size_t restoredSize = Decode(compressed.data(), size, restored.data(), restored.size());
+            check(restoredSize == text.size() && restored == text, "span round trip " + name);
+            check(Encode(text.data(), text.size(), compressed.data(), size - 1, sets[set]) == SIZE_MAX,
+                  "span encode overflow " + name);
+        }
+    }
+}
+
+// Испорченный поток не должен зависать, падать или требовать памяти больше разумного:
+// все обрезки потока и потоки со случайно измененными байтами
+void testCorrupt() {
+    // {17, 0, ...} - единственный символ с кодом длины 32
+    std::vector<std::vector<byte>> streams = {{17, 5}, {25, 5}, {framed, huffmanBlock, 0x80}, {framed, 1, 4, 200},
+                                              {17, 0, 0, 0, 0, 0x80, 'a', 0xff, 0xff, 0xff, 0xff}};
+    EncodeOptions options;
+    options.blockSize = 1 << 10;
+    for (auto &sample : samples()) {
+        if (sample.second.size() <= 4096) {
+            streams.push_back(encode(sample.second, options));
+            streams.push_back(encode(sample.second, EncodeOptions()));
+        }
+    }
+    std::mt19937 rng(3);
+    std::array<byte, 1 << 16> spanOutput;
+    auto tryAll = [&](const std::vector<byte> &stream) {
+        decode(stream);
+        bool failed;
+        decodePushed(stream, rng, 64, failed);
+        std::vector<byte> slice;
+        VectorOutput sliceOutput(&slice);
+        DecodeRange(stream.data(), stream.size(), 0, 1 << 20, sliceOutput);
+        Decode(stream.data(), stream.size(), spanOutput.data(), spanOutput.size());
+    };
+    for (auto &stream : streams) {
+        size_t end = framedEnd(stream);
+        for (size_t size = 0; size < stream.size(); size += 1 + stream.size() / 64) {
+            std::vector<byte> truncated(stream.begin(), stream.begin() + size);
+            tryAll(truncated);
+            if (size == 0 || size < end) {
+                std::vector<byte> text;
+                check(!decodeTo(truncated, text), "truncated stream is reported at " + std::to_string(size));
+                bool failed = false;
+                decodePushed(truncated, rng, 64, failed);
+                check(failed, "push decoder reports truncated stream at " + std::to_string(size));
+            }
+        }
+        for (int round = 0; round < 20 && !stream.empty(); round++) {
+            std::vector<byte> broken = stream;
+            for (int flip = 0; flip < 3; flip++) {
+                broken[rng() % broken.size()] ^= static_cast<byte>(1 + rng() % 255);
+            }
+            tryAll(broken);
+        }
+    }
+    // длины из заголовков проверяются до выделения памяти: блок в 64 ГБ и 16 ГБ текста в fourStreams
+    std::vector<byte> hugeFrame = {framed, huffmanBlock, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01,
+                                   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01, 0};
+    check(decode(hugeFrame).empty(), "huge frame is rejected");
+    std::vector<byte> hugeStreams = {fourStreams, 0x80, 0x80, 0x80, 0x80, 0x40, 0, 0x02, 'a', 'b', 0, 0, 0, 0};
+    check(decode(hugeStreams).empty(), "huge four-stream block is rejected");
+    std::vector<byte> hugeRun = {runLength, 'a', 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01};
+    check(decode(hugeRun).empty(), "huge run is rejected");
+
+    // поток без рамки копится целиком только до blockBound(maxBlockSize)
+    DecodeOptions small;
+    small.maxBlockSize = 1000;
+    EncodeOptions whole;
+    whole.blockSize = 1 << 20;
+    std::vector<byte> unframed = encode(sample("text 70000"), whole);
+    check(unframed.size() > blockBound(small.maxBlockSize), "unframed sample is long enough");
+    HuffmanDecoder limited(small);
+    size_t accepted = 0;
+    for (size_t pos = 0; pos < unframed.size(); pos += 100) {
+        accepted += limited.feed(unframed.data() + pos, std::min<size_t>(100, unframed.size() - pos));
+    }
+    check(limited.failed() && accepted <= blockBound(small.maxBlockSize), "unframed stream over the limit");
+
+    std::vector<byte> header = {17, 5};
+    check(decode(header).empty(), "truncated header decodes to nothing");
+    bool failed = false;
+    decodePushed(header, rng, 1, failed);
+    check(failed, "push decoder reports truncated header");
+}
+
+// Общая таблица: запись и чтение словаря, блоки withDictionary во всех декодерах
+// и отказ без реестра, с чужим id и на испорченном потоке
+void testDictionary() {
+    auto texts = samples();
+    std::vector<byte> corpus = sample("text 70000");
+    CodeDictionary dictionary(42, corpus.data(), corpus.size());
+    std::vector<byte> saved;
+    VectorOutput savedStream(&saved);
+    dictionary.write(savedStream);
+    VectorInput savedInput(&saved);
+    CodeDictionary restored;
+    check(restored.read(savedInput) && restored.getId() == 42, "dictionary read");
+    bool sameCodes = true;
+    for (int symbol = 0; symbol < 256; symbol++) {
+        sameCodes = sameCodes && restored.codes()[symbol].size == dictionary.codes()[symbol].size
+                    && restored.codes()[symbol].code == dictionary.codes()[symbol].code;
+    }
+    check(sameCodes, "dictionary codes survive write and read");
+    for (size_t size = 0; size < saved.size(); size++) {
+        std::vector<byte> truncated(saved.begin(), saved.begin() + size);
+        VectorInput truncatedInput(&truncated);
+        CodeDictionary broken;
+        check(!broken.read(truncatedInput), "truncated dictionary at " + std::to_string(size));
+    }
+
+    DictionaryRegistry registry;
+    registry.add(restored);
+    DecodeOptions withRegistry;
+    withRegistry.dictionaries = &registry;
+    DictionaryRegistry otherRegistry;
+    otherRegistry.add(CodeDictionary(7, corpus.data(), corpus.size()));
+    DecodeOptions unknownId;
+    unknownId.dictionaries = &otherRegistry;
+
+    EncodeOptions options;
+    options.dictionary = &dictionary;
+    options.blockSize = 256; // в блоках по 1 КБ уже выгоднее свои коды
+    std::mt19937 rng(31);
+    std::vector<std::vector<byte>> streams;
+    // короткий текст из того же алфавита, что и корпус: общая таблица выгоднее своего заголовка
+    std::vector<byte> phrase(corpus.begin(), corpus.begin() + 40);
+    std::vector<byte> single = encode(phrase, options);
+    check(!single.empty() && single[0] == withDictionary, "short text uses the dictionary");
+    texts.push_back({"phrase", phrase});
+    for (auto &sample : texts) {
+        const std::vector<byte> &text = sample.second;
+        std::vector<byte> compressed = encode(text, options);
+        streams.push_back(compressed);
+        if (sample.first == "text 4096") {
+            // блоки рамки тоже берут общую таблицу
+            bool usesDictionary = false;
+            for (auto &block : blockIndex(compressed.data(), compressed.size())) {
+                bool ok = true;
+                size_t pos = block.first + 1;
+                parseVarint(compressed.data(), compressed.size(), pos, ok);
+                parseVarint(compressed.data(), compressed.size(), pos, ok);
+                usesDictionary = usesDictionary || (ok && compressed[pos] == withDictionary);
+            }
+            check(usesDictionary, "framed blocks use the dictionary");
+        }
+        std::vector<byte> decoded;
+        check(decodeTo(compressed, decoded, withRegistry) && decoded == text, "dictionary round trip " + sample.first);
+        bool failed = false;
+        check(decodePushed(compressed, rng, 100, failed, withRegistry) == text && !failed,
+              "dictionary push decoder " + sample.first);
+        std::vector<byte> spanText(text.size());
+        check(Decode(compressed.data(), compressed.size(), spanText.data(), spanText.size(), withRegistry)
+              == text.size() && spanText == text, "dictionary span decode " + sample.first);
+        size_t offset = text.size() / 2;
+        std::vector<byte> slice;
+        VectorOutput sliceOutput(&slice);
+        DecodeRange(compressed.data(), compressed.size(), offset, 3000, sliceOutput, withRegistry);
+        check(slice == std::vector<byte>(text.begin() + offset, text.begin() + std::min(text.size(), offset + 3000)),
+              "dictionary range " + sample.first);
+    }
+
+    // без реестра и с чужим id блок словаря не декодируется, и это видно всем декодерам
+    std::vector<byte> spanOutput(phrase.size());
+    std::vector<std::pair<std::string, DecodeOptions>> failing = {{"unknown id", unknownId},
+                                                                  {"no registry", DecodeOptions()}};
+    for (auto &[name, without] : failing) {
+        std::vector<byte> decoded;
+        check(!decodeTo(single, decoded, without) && decoded.empty(), "stream decode with " + name);
+        check(Decode(single.data(), single.size(), spanOutput.data(), spanOutput.size(), without) == SIZE_MAX,
+              "span decode with " + name);
+        bool failed = false;
+        decodePushed(single, rng, 100, failed, without);
+        check(failed, "push decoder with " + name);
+    }
+
+    // испорченные потоки со словарем: не падают, а обрезанные до endBlock считаются ошибкой
+    for (auto &stream : streams) {
+        size_t end = framedEnd(stream);
+        for (size_t size = 0; size < stream.size(); size += 1 + stream.size() / 64) {
+            std::vector<byte> truncated(stream.begin(), stream.begin() + size);
+            std::vector<byte> decoded;
+            bool ok = decodeTo(truncated, decoded, withRegistry);
+            check(!ok || (size != 0 && size >= end), "truncated dictionary stream at " + std::to_string(size));
+            bool failed;
+            decodePushed(truncated, rng, 64, failed, withRegistry);
+        }
+        for (int round = 0; round < 20 && !stream.empty(); round++) {
+            std::vector<byte> broken = stream;
+            for (int flip = 0; flip < 3; flip++) {
+                broken[rng() % broken.size()] ^= static_cast<byte>(1 + rng() % 255);
+            }
+            decode(broken, withRegistry);
+            bool failed;
+            decodePushed(broken, rng, 64, failed, withRegistry);
+            std::vector<byte> slice;
+            VectorOutput sliceOutput(&slice);
+            DecodeRange(broken.data(), broken.size(), 0, 1 << 20, sliceOutput, withRegistry);
+            std::array<byte, 1 << 16> spanBuffer;
+            Decode(broken.data(), broken.size(), spanBuffer.data(), spanBuffer.size(), withRegistry);
+        }
+    }
+}
+
+int main() {
+    testRoundTrip();
+    testLimitLoss();
+    testCanonicalHeader();
+    testDecodeRange();
+    testPushDecoder();
+    testSpans();
+    testCorrupt();
+    testDictionary();
+    if (failures == 0) {
+        std::cout << "codec tests OK" << std::endl;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -40,6 +40,8 @@ struct SymbolNode {
 
 class VectorInput : public IInputStream {
 public:
+    using IInputStream::Read;
+
     explicit VectorInput(std::vector<byte> *bytes) : bytes(bytes), pos(0) {}
 
     bool Read(byte &value) {
@@ -61,6 +63,8 @@ private:
 
 class VectorOutput : public IOutputStream {
 public:
+    using IOutputStream::Write;
+
     explicit VectorOutput(std::vector<byte> *bytes) : bytes(bytes) {}
 
     void Write(byte &value) {
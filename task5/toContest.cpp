@@ -2,10 +2,14 @@
 #include <utility>
 #include <vector>
 #include <array>
-#include <queue>
-#include <memory>
-#include <unordered_map>
-#include <stack>
+#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include <iterator>
+#include <cstring>
+#include <future>
+#include <thread>
 #include "Huffman.h"
 
 typedef unsigned char byte;
@@ -17,29 +21,10 @@ struct MapNode {
     MapNode() : size(0), code(0) {}
 };
 
-struct SymbolNode {
-    byte symbol;
-    size_t frequency;
-    std::shared_ptr<SymbolNode> left;
-    std::shared_ptr<SymbolNode> right;
-
-    SymbolNode()
-            : symbol('\0'), frequency(0),
-              left(nullptr), right(nullptr) {}
-
-    explicit SymbolNode(byte symbol)
-            : symbol(symbol),
-              frequency(0),
-              left(nullptr), right(nullptr) {}
-
-    SymbolNode(byte symbol, size_t frequency)
-            : symbol(symbol),
-              frequency(frequency),
-              left(nullptr), right(nullptr) {}
-};
-
 class VectorInput : public IInputStream {
 public:
+    using IInputStream::Read;
+
     explicit VectorInput(std::vector<byte> *bytes) : bytes(bytes), pos(0) {}
 
     bool Read(byte &value) {
@@ -50,6 +35,16 @@ public:
         return true;
     }
 
+    size_t Read(byte *dst, size_t count) {
+        count = std::min(count, bytes->size() - pos);
+        if (count == 0) {
+            return 0;
+        }
+        std::memcpy(dst, bytes->data() + pos, count);
+        pos += count;
+        return count;
+    }
+
     void reset() {
         pos = 0;
     }
@@ -59,87 +54,362 @@ private:
     size_t pos;
 };
 
+// поток над чужим куском памяти, без копирования
+class MemoryInput : public IInputStream {
+public:
+    using IInputStream::Read;
+
+    MemoryInput(const byte *data, size_t size) : data(data), size(size), pos(0) {}
+
+    bool Read(byte &value) {
+        if (pos >= size) {
+            return false;
+        }
+        value = data[pos++];
+        return true;
+    }
+
+    size_t Read(byte *dst, size_t count) {
+        count = std::min(count, size - pos);
+        if (count == 0) {
+            return 0;
+        }
+        std::memcpy(dst, data + pos, count);
+        pos += count;
+        return count;
+    }
+
+private:
+    const byte *data;
+    size_t size;
+    size_t pos;
+};
+
 class VectorOutput : public IOutputStream {
 public:
+    using IOutputStream::Write;
+
     explicit VectorOutput(std::vector<byte> *bytes) : bytes(bytes) {}
 
     void Write(byte &value) {
         bytes->push_back(value);
     }
 
+    void Write(const byte *src, size_t count) {
+        bytes->insert(bytes->end(), src, src + count);
+    }
+
 private:
     std::vector<byte> *bytes;
 };
 
+// поток в чужой буфер фиксированного размера: что не поместилось, отбрасывается, но учитывается в size
+class MemoryOutput : public IOutputStream {
+public:
+    using IOutputStream::Write;
+
+    MemoryOutput(byte *data, size_t capacity) : data(data), capacity(capacity), pos(0) {}
+
+    void Write(byte &value) {
+        if (pos < capacity) {
+            data[pos] = value;
+        }
+        pos++;
+    }
+
+    void Write(const byte *src, size_t count) {
+        size_t fits = pos < capacity ? std::min(count, capacity - pos) : 0;
+        if (fits > 0) {
+            std::memcpy(data + pos, src, fits);
+        }
+        pos += count;
+    }
+
+    size_t size() const {
+        return pos;
+    }
+
+    bool overflowed() const {
+        return pos > capacity;
+    }
+
+private:
+    byte *data;
+    size_t capacity;
+    size_t pos;
+};
+
+// 8 байт начиная с src, первый байт - младший
+inline std::uint64_t loadWord(const byte *src) {
+    std::uint64_t word = 0;
+    for (int i = 7; i >= 0; i--) {
+        word = (word << 8) | src[i];
+    }
+    return word;
+}
+
+// Биты идут с младшего бита байта. Оба потока держат 64-битное окно и буферизуют
+// байты пачками, так что на чтение или запись кода уходит несколько сдвигов
 class BitInputStream {
 public:
-    explicit BitInputStream(IInputStream &input) : inputStream(input), bitPos(0), buff(0) {}
+    explicit BitInputStream(IInputStream &input)
+            : inputStream(input), window(0), windowBits(0), sourceEnded(false), bufferPos(0), bufferEnd(0), fetched(0) {}
 
     bool readBit(byte &res) {
-        if (bitPos == 0) {
-            bool readRes = inputStream.Read(buff);
-            if (!readRes) {
-                return false;
-            }
-        }
-        res = (buff >> (bitPos++)) & 1;
-        if (bitPos == 8) {
-            bitPos = 0;
+        std::uint64_t bit;
+        if (!readBits(1, bit)) {
+            return false;
         }
+        res = static_cast<byte>(bit);
         return true;
     }
 
     bool readByte(byte &res) {
-        res = 0;
-        for (int i = 0; i < 8; i++) {
-            byte bit = 0;
-            bool isReadable = readBit(bit);
-            if (!isReadable) return false;
-            res = res | ((bit & 1) << i);
+        std::uint64_t bits;
+        if (!readBits(8, bits)) {
+            return false;
+        }
+        res = static_cast<byte>(bits);
+        return true;
+    }
+
+    // count <= 57; false, если в потоке осталось меньше count бит
+    bool readBits(byte count, std::uint64_t &res) {
+        if (windowBits < count) {
+            refill();
+            if (windowBits < count) {
+                return false;
+            }
         }
+        res = peekBits(count);
+        skipBits(count);
         return true;
     }
 
+    // пропускает остаток текущего байта
+    void alignToByte() {
+        skipBits(windowBits & 7);
+    }
+
+    // только по границе байта; возвращает сколько байт прочитано
+    size_t readBytes(byte *dst, size_t count) {
+        size_t done = 0;
+        while (done < count && windowBits >= 8) {
+            dst[done++] = static_cast<byte>(window);
+            skipBits(8);
+        }
+        // load кладет в окно выше windowBits и байты, которые еще лежат в буфере;
+        // дальше они копируются мимо окна, поэтому окно очищается
+        if (done < count) {
+            window = 0;
+        }
+        size_t buffered = std::min(count - done, bufferEnd - bufferPos);
+        std::memcpy(dst + done, buffer.data() + bufferPos, buffered);
+        bufferPos += buffered;
+        done += buffered;
+        while (done < count && !sourceEnded) {
+            size_t got = inputStream.Read(dst + done, count - done);
+            sourceEnded = got == 0;
+            done += got;
+            fetched += got;
+        }
+        return done;
+    }
+
+    // сколько байт входного потока уже прочитано; только по границе байта
+    size_t position() const {
+        return fetched - (bufferEnd - bufferPos) - windowBits / 8;
+    }
+
+    // дочитывает байты в окно, пока в нем есть место; false, если битов не осталось
+    bool refill() {
+        return windowBits > 56 || load();
+    }
+
+    // следующие count бит без продвижения, за концом потока - нули.
+    // Сдвиг 64-битного слова на 64 не определен, поэтому полное окно обрабатывается отдельно
+    std::uint64_t peekBits(byte count) const {
+        return count < 64 ? window & ((static_cast<std::uint64_t>(1) << count) - 1) : window;
+    }
+
+    void skipBits(byte count) {
+        window = count < 64 ? window >> count : 0;
+        windowBits -= count;
+    }
+
+    byte available() const {
+        return windowBits;
+    }
+
+    // входной поток закончился, и в окне лежат последние биты
+    bool isExhausted() const {
+        return sourceEnded && bufferPos == bufferEnd;
+    }
+
 private:
+    static constexpr size_t bufferSize = 1 << 12;
+
+    bool load() {
+        if (bufferEnd - bufferPos >= 8) {
+            // берем сразу 8 байт и оставляем в окне только целые байты, которые в него влезли
+            window |= loadWord(buffer.data() + bufferPos) << windowBits;
+            byte taken = (63 - windowBits) >> 3;
+            bufferPos += taken;
+            windowBits += taken << 3;
+        } else {
+            while (windowBits <= 56) {
+                if (bufferPos == bufferEnd && !fill()) {
+                    break;
+                }
+                window |= static_cast<std::uint64_t>(buffer[bufferPos++]) << windowBits;
+                windowBits += 8;
+            }
+        }
+        // конец потока проверяем сразу, чтобы isExhausted не пропустил дополнение последнего байта в окне
+        if (bufferPos == bufferEnd && !sourceEnded) {
+            fill();
+        }
+        return windowBits > 0;
+    }
+
+    bool fill() {
+        bufferPos = 0;
+        bufferEnd = 0;
+        if (!sourceEnded) {
+            bufferEnd = inputStream.Read(buffer.data(), bufferSize);
+            sourceEnded = bufferEnd == 0;
+            fetched += bufferEnd;
+        }
+        return bufferEnd > 0;
+    }
+
     IInputStream &inputStream;
-    byte buff;
-    byte bitPos;
+    std::uint64_t window; // младший бит окна - следующий бит потока
+    byte windowBits;
+    bool sourceEnded;
+    std::array<byte, bufferSize> buffer;
+    size_t bufferPos;
+    size_t bufferEnd;
+    size_t fetched; // байт получено из inputStream
+};
+
+// Чтение бит прямо из памяти, без виртуальных вызовов. За концом данных - нули,
+// поэтому читающий сам должен знать, сколько символов в потоке
+class MemoryBitReader {
+public:
+    MemoryBitReader() : pos(nullptr), end(nullptr), window(0), windowBits(0) {}
+
+    MemoryBitReader(const byte *begin, const byte *end) : pos(begin), end(end), window(0), windowBits(0) {
+        refill();
+    }
+
+    void refill() {
+        if (end - pos >= 8) {
+            window |= loadWord(pos) << windowBits;
+            byte taken = (63 - windowBits) >> 3;
+            pos += taken;
+            windowBits += taken << 3;
+            return;
+        }
+        while (windowBits <= 56 && pos < end) {
+            window |= static_cast<std::uint64_t>(*pos++) << windowBits;
+            windowBits += 8;
+        }
+        if (pos == end) {
+            windowBits = 64;
+        }
+    }
+
+    std::uint64_t peekBits(byte count) const {
+        return count < 64 ? window & ((static_cast<std::uint64_t>(1) << count) - 1) : window;
+    }
+
+    void skipBits(byte count) {
+        window = count < 64 ? window >> count : 0;
+        windowBits -= count;
+    }
+
+private:
+    const byte *pos;
+    const byte *end;
+    std::uint64_t window;
+    byte windowBits;
 };
 
 class BitOutputStream {
 public:
-    explicit BitOutputStream(IOutputStream &output) : outputStream(output), bitPos(0), buff(0) {}
+    explicit BitOutputStream(IOutputStream &output)
+            : outputStream(output), accumulator(0), accumulatorBits(0), bufferPos(0) {}
 
     void writeByte(byte b) {
-        for (byte i = 0; i < 8; i++) {
-            writeBit(((b >> i) & 1));
-        }
+        writeBits(b, 8);
     }
 
-    void writeBits(unsigned int code, byte size) {
-        for (byte i = 0; i < size; i++) {
-            writeBit(((code >> i) & 1));
+    // size <= 57, биты code старше size должны быть нулевыми
+    void writeBits(std::uint64_t code, byte size) {
+        if (accumulatorBits + size > 64) {
+            flushBytes();
         }
+        accumulator |= code << accumulatorBits;
+        accumulatorBits += size;
     }
 
     void writeBit(byte bit) {
-        if (bitPos == 8) {
-            flush();
-        }
-        buff = buff | ((bit & 1) << (bitPos++));
+        writeBits(bit & 1, 1);
+    }
+
+    // только по границе байта
+    void writeBytes(const byte *src, size_t count) {
+        flushBytes();
+        drain();
+        outputStream.Write(src, count);
     }
 
+    // дописывает неполный байт нулями и отдает все в выходной поток
     void flush() {
-        outputStream.Write(buff);
-        buff = 0;
-        bitPos = 0;
+        flushBytes();
+        if (accumulatorBits > 0) {
+            put(static_cast<byte>(accumulator));
+            accumulator = 0;
+            accumulatorBits = 0;
+        }
+        drain();
     }
 
 private:
-    IOutputStream &outputStream;
-    byte buff;
-    byte bitPos;
+    static constexpr size_t bufferSize = 1 << 12;
+
+    // переносит целые байты из аккумулятора в буфер, в аккумуляторе остается меньше 8 бит
+    void flushBytes() {
+        byte bytes = accumulatorBits >> 3;
+        if (bufferPos + 8 > bufferSize) {
+            drain();
+        }
+        for (byte i = 0; i < bytes; i++) {
+            buffer[bufferPos + i] = static_cast<byte>(accumulator >> (i << 3));
+        }
+        bufferPos += bytes;
+        accumulator = bytes == 8 ? 0 : accumulator >> (bytes << 3);
+        accumulatorBits &= 7;
+    }
+
+    void put(byte b) {
+        if (bufferPos == bufferSize) {
+            drain();
+        }
+        buffer[bufferPos++] = b;
+    }
+
+    void drain() {
+        outputStream.Write(buffer.data(), bufferPos);
+        bufferPos = 0;
+    }
 
+    IOutputStream &outputStream;
+    std::uint64_t accumulator;
+    byte accumulatorBits;
+    std::array<byte, bufferSize> buffer;
+    size_t bufferPos;
 };
 
 
@@ -150,9 +420,45 @@ public:
     }
 
     void count(IInputStream &text) {
-        byte symbol;
-        while (text.Read(symbol)) {
-            symbols[symbol]++;
+        std::array<byte, 1 << 12> chunk;
+        while (size_t got = text.Read(chunk.data(), chunk.size())) {
+            count(chunk.data(), got);
+        }
+    }
+
+    // Четыре таблицы 32-битных счетчиков: соседние байты, даже одинаковые, увеличивают
+    // разные ячейки и не ждут друг друга. Таблицы сливаются в общие счетчики после каждого
+    // куска, чтобы 32 бит хватало при любом размере текста
+    void count(const byte *text, size_t size) {
+        if (size < 1024) {
+            for (size_t i = 0; i < size; i++) {
+                symbols[text[i]]++;
+            }
+            return;
+        }
+        static constexpr size_t chunkSize = static_cast<size_t>(1) << 30;
+        std::array<std::array<std::uint32_t, 256>, 4> tables;
+        for (size_t begin = 0; begin < size; begin += chunkSize) {
+            size_t end = std::min(size, begin + chunkSize);
+            for (auto &table : tables) {
+                table.fill(0);
+            }
+            size_t i = begin;
+            for (; i + 16 <= end; i += 16) {
+                for (size_t k = 0; k < 16; k += 4) {
+                    tables[0][text[i + k]]++;
+                    tables[1][text[i + k + 1]]++;
+                    tables[2][text[i + k + 2]]++;
+                    tables[3][text[i + k + 3]]++;
+                }
+            }
+            for (; i < end; i++) {
+                tables[0][text[i]]++;
+            }
+            for (int symbol = 0; symbol < 256; symbol++) {
+                symbols[symbol] += static_cast<size_t>(tables[0][symbol]) + tables[1][symbol]
+                                   + tables[2][symbol] + tables[3][symbol];
+            }
         }
     }
 
@@ -160,17 +466,12 @@ public:
         return symbols[symbol];
     }
 
-    template<class Heap_t>
-    void makeMinHeap(Heap_t &heap) {
-        for (int i = 0; i < 256; i++) {
-            if (symbols[i] > 0) {
-                heap.push(std::make_shared<SymbolNode>(i, symbols[i]));
-            }
-        }
+    size_t frequencyAt(byte symbol) const {
+        return symbols[symbol];
     }
 
-    size_t frequencyAt(byte symbol) {
-        return symbols[symbol];
+    void add(byte symbol, size_t times) {
+        symbols[symbol] += times;
     }
 
 private:
@@ -179,294 +480,1643 @@ private:
 
 class HuffmanTree {
 public:
-    HuffmanTree() : root(nullptr), lastNode(nullptr) {}
+    // коды длиннее maxCodeLength перестраиваются package-merge, чтобы код помещался в unsigned int
+    // и декодировался одним обращением к таблице
+    static constexpr byte defaultMaxCodeLength = 11;
+    static constexpr byte longestCodeLength = 32; // ширина unsigned int в MapNode::code
 
-    explicit HuffmanTree(IInputStream &text) : root(nullptr), lastNode(nullptr) {
+    HuffmanTree() : symbolCount(0), limitLoss(0) {}
+
+    explicit HuffmanTree(IInputStream &text, byte maxCodeLength = defaultMaxCodeLength)
+            : symbolCount(0), limitLoss(0) {
         counter.count(text);
+        build(maxCodeLength);
+    }
 
+    HuffmanTree(const byte *text, size_t size, byte maxCodeLength = defaultMaxCodeLength)
+            : symbolCount(0), limitLoss(0) {
+        counter.count(text, size);
+        build(maxCodeLength);
+    }
 
-        auto comp = [](std::shared_ptr<SymbolNode> &l, std::shared_ptr<SymbolNode> &r) {
-            return l->frequency > r->frequency;
-        };
-        std::priority_queue<std::shared_ptr<SymbolNode>,
-                std::vector<std::shared_ptr<SymbolNode>>,
-                decltype(comp)> minHeap(comp);
+    HuffmanTree(const CounterSymbols &counts, byte maxCodeLength)
+            : symbolCount(0), limitLoss(0), counter(counts) {
+        build(maxCodeLength);
+    }
 
-        counter.makeMinHeap(minHeap);
+    // старый формат: форма дерева в прямом обходе, 1 - внутренний узел, 0 и байт - лист
+    void treeRead(BitInputStream &ss) {
+        _treeRead(ss, 0, 0);
+    }
 
-        while (minHeap.size() > 1) {
-            auto first = minHeap.top();
-            minHeap.pop();
-            auto second = minHeap.top();
-            minHeap.pop();
-            auto combo = std::make_shared<SymbolNode>('\0', first->frequency + second->frequency);
-            combo->left = first;
-            combo->right = second;
-            minHeap.push(combo);
+    // заголовок из одних длин кодов: n - 1, затем по уровням количество кодов этой длины,
+    // затем символы в каноническом порядке. Ширина счетчика уровня - сколько бит нужно,
+    // чтобы записать min(свободных кодов на уровне, оставшихся символов)
+    void lengthsWrite(BitOutputStream &ss) {
+        std::array<byte, 256> order;
+        size_t total = canonicalOrder(order);
+        ss.writeByte(static_cast<byte>(total - 1));
+        size_t slots = 2;
+        size_t remaining = total;
+        size_t pos = 0;
+        for (byte length = 1; remaining > 0; length++) {
+            size_t count = 0;
+            while (pos + count < total && codeMap[order[pos + count]].size == length) {
+                count++;
+            }
+            ss.writeBits(count, bitWidth(std::min(slots, remaining)));
+            pos += count;
+            remaining -= count;
+            slots = std::min((slots - count) * 2, static_cast<size_t>(512));
+        }
+        for (size_t i = 0; i < total; i++) {
+            ss.writeByte(order[i]);
         }
-
-        root = minHeap.top();
-        makeCodeMap();
     }
 
+    // false, если заголовок обрезан или не задает префиксный код
+    bool lengthsRead(BitInputStream &ss) {
+        byte last = 0;
+        if (!ss.readByte(last)) {
+            return false;
+        }
+        size_t total = static_cast<size_t>(last) + 1;
+        std::array<byte, 256> lengths;
+        size_t read = 0;
+        size_t slots = 2;
+        size_t remaining = total;
+        for (byte length = 1; remaining > 0; length++) {
+            std::uint64_t count = 0;
+            if (length > longestCodeLength || slots == 0
+                || !ss.readBits(bitWidth(std::min(slots, remaining)), count) || count > std::min(slots, remaining)) {
+                return false;
+            }
+            std::fill(lengths.begin() + read, lengths.begin() + read + count, length);
+            read += count;
+            remaining -= count;
+            slots = std::min((slots - count) * 2, static_cast<size_t>(512));
+        }
+        for (size_t i = 0; i < read; i++) {
+            byte symbol = 0;
+            if (!ss.readByte(symbol) || codeMap[symbol].size != 0) {
+                return false;
+            }
+            symbolCount++;
+            codeMap[symbol].size = lengths[i];
+        }
+        makeCanonical();
+        return true;
+    }
 
-    void treeWrite(BitOutputStream &ss) {
-        _treeWrite(root, ss);
+    size_t lengthsBits() {
+        size_t bits = 8 + 8 * symbolCount;
+        size_t slots = 2;
+        size_t remaining = symbolCount;
+        std::array<size_t, 256> counts{};
+        for (auto &node : codeMap) {
+            counts[node.size]++;
+        }
+        for (byte length = 1; remaining > 0; length++) {
+            bits += bitWidth(std::min(slots, remaining));
+            remaining -= counts[length];
+            slots = std::min((slots - counts[length]) * 2, static_cast<size_t>(512));
+        }
+        return bits;
     }
 
-    void treeRead(BitInputStream &ss) {
-        root = _treeRead(ss);
+    size_t messageBits() {
+        return messageBits(codeMap);
     }
 
-    byte lastUsedBits() {
+    // длина текста в битах, если кодировать его чужой таблицей codes
+    size_t messageBits(const std::array<MapNode, 256> &codes) {
         size_t bitsOfMessage = 0;
-        for (auto pair: codeMap) {
-            bitsOfMessage += pair.second.size * counter.frequencyAt(pair.first);
+        for (int symbol = 0; symbol < 256; symbol++) {
+            bitsOfMessage += codes[symbol].size * counter.frequencyAt(symbol);
         }
-        size_t bitsOfTree = codeMap.size() * 10 - 1;
-        return (bitsOfMessage + bitsOfTree) % 8;
+        return bitsOfMessage;
+    }
+
+    byte lastUsedBits(size_t bitsOfHeader) {
+        return (messageBits() + bitsOfHeader) % 8;
     }
 
-    std::pair<bool, char> getByBits(byte bit) {
-        if (!lastNode) {
-            if (!root) {
-                return {false, '\0'};
+    std::array<MapNode, 256> codeMap; // size == 0 - символа нет в тексте
+    size_t symbolCount;
+    size_t limitLoss; // на сколько бит ограничение длины удлинило сообщение
+private:
+
+    // Дерево в массиве из 2n - 1 узлов: листья отсортированы по частоте, а внутренние узлы
+    // создаются с неубывающими весами, так что два самых легких узла всегда в начале
+    // одного из двух списков и куча не нужна
+    void build(byte maxCodeLength) {
+        std::array<byte, 256> leafSymbol;
+        size_t n = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (counter.frequencyAt(symbol) > 0) {
+                leafSymbol[n++] = symbol;
             }
-            if (!root->left && !root->right) {
-                return {true, root->symbol};
+        }
+        std::sort(leafSymbol.begin(), leafSymbol.begin() + n, [this](byte l, byte r) {
+            return std::make_pair(counter.frequencyAt(l), l) < std::make_pair(counter.frequencyAt(r), r);
+        });
+        symbolCount = n;
+        if (n < 2) {
+            if (n == 1) {
+                codeMap[leafSymbol[0]].size = 1;
             }
-            lastNode = root;
+            return;
         }
-        if (bit == 0) {
-            lastNode = lastNode->left;
-        } else {
-            lastNode = lastNode->right;
+
+        std::array<size_t, 511> weight;
+        std::array<short, 511> parent;
+        for (size_t i = 0; i < n; i++) {
+            weight[i] = counter.frequencyAt(leafSymbol[i]);
+        }
+        size_t leaf = 0;
+        size_t inner = n;
+        auto lightest = [&](size_t next) {
+            if (leaf < n && (inner == next || weight[leaf] <= weight[inner])) {
+                return leaf++;
+            }
+            return inner++;
+        };
+        for (size_t next = n; next < 2 * n - 1; next++) {
+            size_t first = lightest(next);
+            size_t second = lightest(next);
+            weight[next] = weight[first] + weight[second];
+            parent[first] = parent[second] = static_cast<short>(next);
         }
 
-        if (!lastNode->left && !lastNode->right) {
-            byte symbol = lastNode->symbol;
-            lastNode = nullptr;
-            return {true, symbol};
-        } else {
-            return {false, '\0'};
+        // родитель всегда создан позже детей, поэтому глубины считаются одним проходом от корня
+        std::array<byte, 511> depth;
+        depth[2 * n - 2] = 0;
+        byte longest = 0;
+        for (size_t i = 2 * n - 2; i-- > 0;) {
+            depth[i] = depth[parent[i]] + 1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            codeMap[leafSymbol[i]].size = depth[i];
+            longest = std::max(longest, depth[i]);
+        }
+
+        // меньше чем в bitWidth(n - 1) бит n символов не закодировать
+        maxCodeLength = std::max(std::min(maxCodeLength, longestCodeLength), bitWidth(n - 1));
+        if (longest > maxCodeLength) {
+            size_t before = messageBits();
+            limitLengths(maxCodeLength);
+            limitLoss = messageBits() - before;
         }
+        makeCanonical();
     }
 
-    std::unordered_map<byte, MapNode> codeMap;
-private:
+    // package-merge: длина кода символа - сколько раз он попал в 2n - 2 самых легких
+    // элементов после maxLength - 1 раундов упаковки пар и слияния с листьями.
+    // Раунды хранят только веса и пометку "пакет"; символы восстанавливаются обратным проходом:
+    // p пакетов среди первых элементов раунда - это первые 2p элементов предыдущего раунда
+    void limitLengths(byte maxLength) {
+        std::array<byte, 256> leaves;
+        size_t n = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (codeMap[symbol].size > 0) {
+                leaves[n++] = symbol;
+            }
+        }
+        std::sort(leaves.begin(), leaves.begin() + n, [this](byte l, byte r) {
+            return std::make_pair(counter.frequencyAt(l), l) < std::make_pair(counter.frequencyAt(r), r);
+        });
+
+        // в раунде не больше n листьев и n - 1 пакетов
+        std::array<std::array<bool, 512>, 32> isPackage;
+        std::array<size_t, 512> current;
+        std::array<size_t, 512> merged;
+        size_t currentSize = n;
+        for (size_t i = 0; i < n; i++) {
+            current[i] = counter.frequencyAt(leaves[i]);
+        }
+        for (byte round = 1; round < maxLength; round++) {
+            size_t packages = currentSize / 2;
+            size_t leaf = 0;
+            size_t package = 0;
+            size_t size = 0;
+            // при равных весах лист идет раньше пакета
+            while (leaf < n || package < packages) {
+                size_t packageWeight = package < packages ? current[2 * package] + current[2 * package + 1] : 0;
+                bool takePackage = package < packages
+                                   && (leaf == n || packageWeight < counter.frequencyAt(leaves[leaf]));
+                isPackage[round][size] = takePackage;
+                merged[size++] = takePackage ? packageWeight : counter.frequencyAt(leaves[leaf]);
+                if (takePackage) {
+                    package++;
+                } else {
+                    leaf++;
+                }
+            }
+            current = merged;
+            currentSize = size;
+        }
 
-    void makeCodeMap() {
-        enum NodeType {
-            rootWas, leftDone, rightDone
-        };
-        std::stack<std::shared_ptr<SymbolNode>> history;
-        std::stack<byte> description;
-        MapNode currMapNode;
-        history.push(root);
-        description.push(rootWas);
-        while (!history.empty()) {
-            switch (description.top()) {
-                case rootWas:
-                    if (history.top()->left) {
-                        currMapNode.size++;
-                        history.push(history.top()->left);
-                        description.push(rootWas);
-                    } else {
-                        if (!history.top()->right) {
-                            codeMap.insert({history.top()->symbol, currMapNode});
-                            currMapNode.code = (currMapNode.code) ^ 1 << currMapNode.size--;
-                        }
-                        description.top() = leftDone;
-                    }
-                    break;
-                case leftDone:
-                    currMapNode.code = (currMapNode.code) | 1 << currMapNode.size++;
-                    if (history.top()->right) {
-                        history.push(history.top()->right);
-                        description.push(rootWas);
-                    } else {
-                        description.top() = rightDone;
-                    }
-                    break;
-                case rightDone:
-                    currMapNode.code = (currMapNode.code) ^ 1 << currMapNode.size--;
-                    history.pop();
-                    description.pop();
-                    if (description.empty()) {
-                        break;
-                    }
-                    if (description.top() == rootWas) {
-                        description.top() = leftDone;
-                    } else {
-                        description.top() = rightDone;
-                    }
-                    break;
+        for (auto &node : codeMap) {
+            node.size = 0;
+        }
+        size_t take = 2 * n - 2;
+        for (byte round = maxLength - 1; round > 0; round--) {
+            size_t packages = 0;
+            size_t leaf = 0;
+            for (size_t i = 0; i < take; i++) {
+                if (isPackage[round][i]) {
+                    packages++;
+                } else {
+                    codeMap[leaves[leaf++]].size++;
+                }
             }
+            take = 2 * packages;
+        }
+        for (size_t i = 0; i < take; i++) {
+            codeMap[leaves[i]].size++;
         }
     }
 
-    void _treeWrite(std::shared_ptr<SymbolNode> &node, BitOutputStream &ss) {
-        if (!node->left && !node->right) {
-            ss.writeBit(0);
-            ss.writeByte(node->symbol);
-        } else {
-            ss.writeBit(1);
-            _treeWrite(node->left, ss);
-            _treeWrite(node->right, ss);
+    static byte bitWidth(size_t value) {
+        byte width = 0;
+        while (value >> width) {
+            width++;
         }
+        return width;
     }
 
-    std::shared_ptr<SymbolNode> _treeRead(BitInputStream &ss) {
-        auto node = std::make_shared<SymbolNode>();
-        byte currentBit;
-        ss.readBit(currentBit);
-        if (currentBit == 0) {
-            byte symbol;
-            ss.readByte(symbol);
-            node->symbol = symbol;
-        } else {
-            node->left = _treeRead(ss);
-            node->right = _treeRead(ss);
+    // символы по возрастанию (длина кода, символ), возвращает их количество
+    size_t canonicalOrder(std::array<byte, 256> &order) {
+        size_t total = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (codeMap[symbol].size > 0) {
+                order[total++] = symbol;
+            }
         }
-        return node;
+        std::sort(order.begin(), order.begin() + total, [this](byte l, byte r) {
+            return std::make_pair(codeMap[l].size, l) < std::make_pair(codeMap[r].size, r);
+        });
+        return total;
     }
 
-    std::shared_ptr<SymbolNode> root;
-    std::shared_ptr<SymbolNode> lastNode;
-    CounterSymbols counter;
-};
+    // переназначает коды по длинам: канонический код читается со старшего бита,
+    // а поток пишется с младшего, поэтому храним его развернутым
+    void makeCanonical() {
+        std::array<byte, 256> order;
+        size_t total = canonicalOrder(order);
+        // код длины longestCodeLength сдвигается на все 32 бита, поэтому считаем в 64-битном слове
+        std::uint64_t code = 0;
+        byte prevSize = 0;
+        for (size_t i = 0; i < total; i++) {
+            MapNode &node = codeMap[order[i]];
+            code <<= node.size - prevSize;
+            prevSize = node.size;
+            unsigned int reversed = 0;
+            for (byte bit = 0; bit < node.size; bit++) {
+                reversed |= static_cast<unsigned int>((code >> bit) & 1) << (node.size - 1 - bit);
+            }
+            node.code = reversed;
+            code++;
+        }
+    }
 
-void copyText(IInputStream &original, std::vector<byte> &text) {
-    byte symbol;
-    while (original.Read(symbol)) {
-        text.push_back(symbol);
+    // код листа - путь от корня: 0 - налево, 1 - направо, первый шаг в младшем бите
+    void _treeRead(BitInputStream &ss, unsigned int code, byte depth) {
+        byte currentBit = 0;
+        if (!ss.readBit(currentBit)) {
+            return;
+        }
+        if (currentBit == 0) {
+            byte symbol = 0;
+            ss.readByte(symbol);
+            if (codeMap[symbol].size == 0) {
+                symbolCount++;
+            }
+            codeMap[symbol].size = depth;
+            codeMap[symbol].code = code;
+        } else if (depth < 32) {
+            _treeRead(ss, code, depth + 1);
+            _treeRead(ss, code | 1u << depth, depth + 1);
+        }
     }
-}
 
-enum EncodingType {
-    notEncoded = 8
+    CounterSymbols counter;
 };
 
-void Encode(IInputStream &original, IOutputStream &compressed) {
-    std::vector<byte> text;
-
-    copyText(original, text);
-    VectorInput originalStream(&text); // копируем и создаем свой поток для того, чтобы была возможность
-    //вернуться к началу потока
-    BitOutputStream output(compressed);
-    byte _byte; //вспомогательная переменная
+// Таблица декодирования: по следующим tableBits битам потока сразу дает символ и длину его кода.
+// Коды длиннее tableBits продолжаются в таблицах следующего уровня, на которые ссылается запись.
+// Первый уровень лежит в самом объекте, так что для кодов не длиннее tableBits память не выделяется
+class DecodeTable {
+public:
+    static constexpr byte tableBits = 11;
 
-    //если в тексте меньше 8 символов, то кодировать не стоит и записывам все как есть
-    if (text.size() < 8) {
-        output.writeByte(notEncoded);
-        while (originalStream.Read(_byte)) {
-            output.writeByte(_byte);
-        }
-        output.flush();
-        return;
+    DecodeTable() : longestCode(0) {
+        first.fill(Entry{0, 0, false});
     }
 
-    HuffmanTree tree(originalStream); // создаем префиксное дерево и хеш таблицу для символов
-
-    originalStream.reset(); // возвращаемся на начало потока
-
-    //если сообщение состоит из одного символа
-    if (tree.codeMap.size() == 1) {
-        byte lastUsedBits = text.size() % 8;
-        output.writeByte(9 + lastUsedBits); //в зоголовке говорим, что сообщение состоит только из одного символа
-        for (auto pair : tree.codeMap) { //выполнится один раз так как в таблице только один элемент
-            byte symbol;
-            output.writeByte(pair.first);
-            while (originalStream.Read(symbol)) {
-                output.writeBit(1);
+    explicit DecodeTable(const std::array<MapNode, 256> &codeMap) : longestCode(0) {
+        std::array<Code, 256> codes;
+        size_t count = 0;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (codeMap[symbol].size > 0) {
+                codes[count++] = {static_cast<byte>(symbol), codeMap[symbol].code, codeMap[symbol].size};
+                longestCode = std::max(longestCode, codeMap[symbol].size);
             }
         }
-        output.flush();
-        return;
+        first.fill(Entry{0, 0, false});
+        buildLevel(codes.data(), count, tableBits, true);
     }
 
-    output.writeByte(tree.lastUsedBits()); //указываем количество полезных бит в последнем байте
-    tree.treeWrite(output);
-
-    //записываем закодированный текст
-    while (originalStream.Read(_byte)) {
-        auto node = tree.codeMap[_byte];
-        output.writeBits(node.code, node.size);
+    byte maxLength() const {
+        return longestCode;
     }
-    output.flush(); //сбрасываем буфер потока
-}
-
-void Decode(IInputStream &compressed, IOutputStream &original) {
-    BitInputStream input(compressed);
-    byte lastUsedBits;
-    input.readByte(lastUsedBits);
 
-    //если данные не закодированы
-    if (lastUsedBits == notEncoded) {
-        byte symbol;
-        while (input.readByte(symbol)) {
-            original.Write(symbol);
+    // false, если из оставшихся usable бит нельзя прочитать целый код
+    template<class Reader>
+    bool decode(Reader &input, byte usable, byte &symbol) const {
+        byte consumed = 0;
+        byte levelBits = tableBits;
+        Entry entry = first[input.peekBits(tableBits)];
+        while (entry.isLink) {
+            consumed += levelBits;
+            levelBits = entry.length;
+            entry = entries[entry.value + (input.peekBits(consumed + levelBits) >> consumed)];
         }
-        return;
+        consumed += entry.length;
+        if (entry.length == 0 || consumed > usable) {
+            return false;
+        }
+        input.skipBits(consumed);
+        symbol = entry.value;
+        return true;
     }
 
-    //если данные состоят из одного символа
-    if (lastUsedBits > 8) {
-        lastUsedBits -= 9;
+private:
+    struct Code {
         byte symbol;
-        input.readByte(symbol);
-        byte bit;
-        std::queue<byte> buffer;
-        while (input.readBit(bit)) {
-            if (buffer.size() < 16) {
-                buffer.push(bit);
-            } else {
-                for (int i = 0; i < 8; i++) {
-                    buffer.pop();
-                    original.Write(symbol);
+        unsigned int code; // первый бит кода - младший
+        byte size;
+    };
+
+    // для символа: value - символ, length - сколько бит кода осталось на этом уровне;
+    // для ссылки: value - начало таблицы следующего уровня, length - ее ширина в битах
+    struct Entry {
+        unsigned int value;
+        byte length;
+        bool isLink;
+    };
+
+    // isFirst - заполнить first, иначе новую таблицу в конце entries; возвращает ее начало
+    size_t buildLevel(const Code *codes, size_t count, byte bits, bool isFirst) {
+        size_t offset = entries.size();
+        if (!isFirst) {
+            entries.resize(offset + (static_cast<size_t>(1) << bits), Entry{0, 0, false});
+        }
+        // entries может переехать при постройке следующих уровней, поэтому адрес берется каждый раз
+        auto level = [&]() {
+            return isFirst ? first.data() : entries.data() + offset;
+        };
+        std::map<unsigned int, std::vector<Code>> longer; // коды, не уместившиеся в уровень, по префиксу
+        for (size_t i = 0; i < count; i++) {
+            const Code &code = codes[i];
+            if (code.size <= bits) {
+                // все записи, у которых младшие size бит совпадают с кодом
+                for (size_t tail = 0; tail < (static_cast<size_t>(1) << (bits - code.size)); tail++) {
+                    level()[code.code | (tail << code.size)] = Entry{code.symbol, code.size, false};
                 }
-                buffer.push(bit);
+            } else {
+                unsigned int prefix = code.code & ((1u << bits) - 1);
+                longer[prefix].push_back({code.symbol, code.code >> bits, static_cast<byte>(code.size - bits)});
             }
         }
-        lastUsedBits = lastUsedBits ? lastUsedBits : 8;
-        byte needReed = buffer.size() - (8 - lastUsedBits);
-        for (int i = 0; i < needReed; i++) {
-            buffer.pop();
-            original.Write(symbol);
-        }
-        return;
-    }
-
-    HuffmanTree tree;
-    tree.treeRead(input);
-
-    byte bit;
-    BitOutputStream output(original);
-    std::queue<byte> buffer;
-    while (input.readBit(bit)) {
-        if (buffer.size() < 16) {
-            buffer.push(bit);
-        } else {
-            for (int i = 0; i < 8; i++) {
-                byte buffBit = buffer.front();
-                buffer.pop();
-                auto res = tree.getByBits(buffBit);
-                if (res.first) {
-                    output.writeByte(res.second);
-                }
+        for (auto &group : longer) {
+            byte subBits = 0;
+            for (auto &code : group.second) {
+                subBits = std::max(subBits, code.size);
             }
-            buffer.push(bit);
+            subBits = std::min(subBits, tableBits);
+            size_t subOffset = buildLevel(group.second.data(), group.second.size(), subBits, false);
+            level()[group.first] = Entry{static_cast<unsigned int>(subOffset), subBits, true};
         }
+        return offset;
     }
-    lastUsedBits = lastUsedBits ? lastUsedBits : 8;
-    byte needReed = buffer.size() - (8 - lastUsedBits);
-    for (int i = 0; i < needReed; i++) {
-        bit = buffer.front();
-        buffer.pop();
-        auto res = tree.getByBits(bit);
-        if (res.first) {
-            output.writeByte(res.second);
+
+    std::array<Entry, static_cast<size_t>(1) << tableBits> first;
+    std::vector<Entry> entries; // следующие уровни
+    byte longestCode;
+};
+
+void copyText(IInputStream &original, std::vector<byte> &text) {
+    std::array<byte, 1 << 12> chunk;
+    while (size_t got = original.Read(chunk.data(), chunk.size())) {
+        text.insert(text.end(), chunk.begin(), chunk.begin() + got);
+    }
+}
+
+// копит байты и отдает их в выходной поток пачками
+class ByteOutputBuffer {
+public:
+    explicit ByteOutputBuffer(IOutputStream &output) : outputStream(output), pos(0) {}
+
+    ~ByteOutputBuffer() {
+        flush();
+    }
+
+    void put(byte value) {
+        if (pos == buffer.size()) {
+            flush();
+        }
+        buffer[pos++] = value;
+    }
+
+    void write(const byte *src, size_t count) {
+        flush();
+        outputStream.Write(src, count);
+    }
+
+    // count копий value
+    void fill(byte value, size_t count) {
+        while (count > 0) {
+            if (pos == buffer.size()) {
+                flush();
+            }
+            size_t part = std::min(count, buffer.size() - pos);
+            std::memset(buffer.data() + pos, value, part);
+            pos += part;
+            count -= part;
+        }
+    }
+
+    void flush() {
+        outputStream.Write(buffer.data(), pos);
+        pos = 0;
+    }
+
+private:
+    IOutputStream &outputStream;
+    std::array<byte, 1 << 12> buffer;
+    size_t pos;
+};
+
+void writeVarint(BitOutputStream &output, size_t value) {
+    while (value >= 0x80) {
+        output.writeByte(static_cast<byte>(value | 0x80));
+        value >>= 7;
+    }
+    output.writeByte(static_cast<byte>(value));
+}
+
+bool readVarint(BitInputStream &input, size_t &value) {
+    value = 0;
+    byte next;
+    for (byte shift = 0; shift < 64; shift += 7) {
+        if (!input.readByte(next)) {
+            return false;
+        }
+        value |= static_cast<size_t>(next & 0x7f) << shift;
+        if (!(next & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Таблица кодов, заранее построенная по обучающему корпусу. Каждому из 256 байт добавляется
+// единица частоты, чтобы у любого символа был код. Сообщение ссылается на таблицу по id
+// и не несет своего заголовка, а таблица декодирования строится один раз при создании
+class CodeDictionary {
+public:
+    CodeDictionary() : id(0) {}
+
+    CodeDictionary(std::uint32_t id, const byte *corpus, size_t size,
+                   byte maxCodeLength = HuffmanTree::defaultMaxCodeLength) : id(id) {
+        CounterSymbols counts;
+        counts.count(corpus, size);
+        for (int symbol = 0; symbol < 256; symbol++) {
+            counts.add(symbol, 1);
+        }
+        tree = HuffmanTree(counts, maxCodeLength);
+        table = DecodeTable(tree.codeMap);
+    }
+
+    // id, затем длины кодов в формате заголовка canonical
+    void write(IOutputStream &output) {
+        BitOutputStream bits(output);
+        writeVarint(bits, id);
+        tree.lengthsWrite(bits);
+        bits.flush();
+    }
+
+    bool read(IInputStream &input) {
+        BitInputStream bits(input);
+        size_t savedId;
+        if (!readVarint(bits, savedId)) {
+            return false;
+        }
+        id = static_cast<std::uint32_t>(savedId);
+        tree = HuffmanTree();
+        if (!tree.lengthsRead(bits)) {
+            return false;
+        }
+        table = DecodeTable(tree.codeMap);
+        return true;
+    }
+
+    std::uint32_t getId() const {
+        return id;
+    }
+
+    const std::array<MapNode, 256> &codes() const {
+        return tree.codeMap;
+    }
+
+    const DecodeTable &decodeTable() const {
+        return table;
+    }
+
+private:
+    std::uint32_t id;
+    HuffmanTree tree;
+    DecodeTable table;
+};
+
+// словари, по которым Decode находит таблицу из заголовка сообщения
+class DictionaryRegistry {
+public:
+    void add(const CodeDictionary &dictionary) {
+        dictionaries[dictionary.getId()] = dictionary;
+    }
+
+    const CodeDictionary *find(std::uint32_t id) const {
+        auto found = dictionaries.find(id);
+        return found == dictionaries.end() ? nullptr : &found->second;
+    }
+
+private:
+    std::map<std::uint32_t, CodeDictionary> dictionaries;
+};
+
+enum EncodingType {
+    notEncoded = 8,
+    oneSymbol = 9, // + количество полезных бит в последнем байте
+    canonical = 17, // + количество полезных бит в последнем байте
+    fourStreams = 25,
+    runLength = 26,
+    indexTrailer = 0x49,
+    withDictionary = 27,
+    framed = 0x20
+};
+
+enum BlockType {
+    endBlock = 0,
+    huffmanBlock = 1
+};
+
+// threads = 0 - по числу ядер; потоки запускаются, только если блоков больше одного
+// interleave - блоки от minInterleaved байт кодируются четырьмя независимыми потоками бит
+// dictionary - общая таблица кодов, блок ссылается на нее, если так короче
+// stats - если задан, Encode пишет сюда итоги кодирования
+struct EncodeStats {
+    size_t limitLossBits; // на сколько бит ограничение maxCodeLength удлинило блоки с кодами Хаффмана
+
+    EncodeStats() : limitLossBits(0) {}
+};
+
+struct EncodeOptions {
+    static constexpr size_t minInterleaved = 1 << 14;
+
+    size_t blockSize;
+    byte maxCodeLength;
+    unsigned threads;
+    bool interleave;
+    const CodeDictionary *dictionary;
+    EncodeStats *stats;
+
+    EncodeOptions()
+            : blockSize(1 << 18), maxCodeLength(HuffmanTree::defaultMaxCodeLength), threads(0), interleave(true),
+              dictionary(nullptr), stats(nullptr) {}
+};
+
+// dictionaries нужны, чтобы декодировать блоки, закодированные словарем.
+// maxBlockSize - самый длинный текст блока, который декодер согласен принять: длины из заголовков
+// проверяются до выделения памяти, так что испорченный поток не просит гигабайты.
+// Поток, закодированный с blockSize больше этого, требует поднять maxBlockSize
+struct DecodeOptions {
+    unsigned threads;
+    const DictionaryRegistry *dictionaries;
+    size_t maxBlockSize;
+
+    DecodeOptions() : threads(0), dictionaries(nullptr), maxBlockSize(1 << 26) {}
+};
+
+size_t readFull(IInputStream &input, byte *dst, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        size_t got = input.Read(dst + done, count - done);
+        if (got == 0) {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+// Текст делится на четыре части, каждая кодируется своим потоком бит, чтобы декодер
+// продвигал их одновременно. Формат: fourStreams, длина текста, длины кодов,
+// выравнивание до байта, размеры первых трех потоков, потоки подряд.
+// Размеры потоков считаются заранее по длинам кодов, и потоки пишутся сразу в выход
+void encodeFourStreams(const byte *text, size_t size, HuffmanTree &tree, BitOutputStream &output) {
+    output.writeByte(fourStreams);
+    writeVarint(output, size);
+    tree.lengthsWrite(output);
+    output.flush();
+
+    size_t quarter = (size + 3) / 4;
+    for (size_t part = 0; part < 3; part++) {
+        size_t bits = 0;
+        size_t end = std::min(size, (part + 1) * quarter);
+        for (size_t i = part * quarter; i < end; i++) {
+            bits += tree.codeMap[text[i]].size;
+        }
+        writeVarint(output, (bits + 7) / 8);
+    }
+    for (size_t part = 0; part < 4; part++) {
+        size_t end = std::min(size, (part + 1) * quarter);
+        for (size_t i = part * quarter; i < end; i++) {
+            const MapNode &node = tree.codeMap[text[i]];
+            output.writeBits(node.code, node.size);
         }
+        output.flush();
+    }
+}
+
+size_t varintSize(size_t value) {
+    size_t bytes = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        bytes++;
+    }
+    return bytes;
+}
+
+// Самое большее, сколько занимает блок из size байт: способ выбирается по оценке, которая
+// не больше size + 1, а заголовок fourStreams может превысить свою оценку на длины потоков
+size_t blockBound(size_t size) {
+    return size + 1 + 4 * varintSize(size);
+}
+
+// размер текста сериями; считаем только до limit, дальше этот способ уже не нужен
+size_t runLengthCost(const byte *text, size_t size, size_t limit) {
+    size_t cost = 1;
+    for (size_t i = 0; i < size && cost < limit;) {
+        size_t run = 1;
+        while (i + run < size && text[i + run] == text[i]) {
+            run++;
+        }
+        cost += 1 + varintSize(run - 1);
+        i += run;
+    }
+    return cost;
+}
+
+// runLength, затем серии [символ, длина серии - 1] до конца потока
+void encodeRuns(const byte *text, size_t size, BitOutputStream &output) {
+    output.writeByte(runLength);
+    for (size_t i = 0; i < size;) {
+        size_t run = 1;
+        while (i + run < size && text[i + run] == text[i]) {
+            run++;
+        }
+        output.writeByte(text[i]);
+        writeVarint(output, run - 1);
+        i += run;
+    }
+    output.flush();
+}
+
+// dictionary, id словаря, длина текста, коды; длина текста заменяет счетчик полезных бит
+void encodeWithDictionary(const byte *text, size_t size, const CodeDictionary &dictionary, BitOutputStream &output) {
+    output.writeByte(withDictionary);
+    writeVarint(output, dictionary.getId());
+    writeVarint(output, size);
+    const std::array<MapNode, 256> &codes = dictionary.codes();
+    for (size_t i = 0; i < size; i++) {
+        output.writeBits(codes[text[i]].code, codes[text[i]].size);
     }
     output.flush();
 }
+
+// кодирует кусок текста целиком: заголовок с форматом, таблица кодов и сами коды.
+// Возвращает, сколько бит блок потерял из-за ограничения длины кода (0, если коды Хаффмана не выбраны)
+size_t encodeBlock(const byte *text, size_t size, IOutputStream &compressed, const EncodeOptions &options) {
+    BitOutputStream output(compressed);
+
+    // общей таблице не нужен заголовок, поэтому она выгодна даже для совсем коротких сообщений
+    size_t dictionaryCost = SIZE_MAX;
+    if (options.dictionary) {
+        const std::array<MapNode, 256> &codes = options.dictionary->codes();
+        size_t bits = 0;
+        for (size_t i = 0; i < size; i++) {
+            bits += codes[text[i]].size;
+        }
+        dictionaryCost = 1 + varintSize(options.dictionary->getId()) + varintSize(size) + (bits + 7) / 8;
+    }
+
+    //если в тексте меньше 8 символов, то кодировать не стоит и записывам все как есть
+    if (size < 8) {
+        if (dictionaryCost < size + 1) {
+            encodeWithDictionary(text, size, *options.dictionary, output);
+            return 0;
+        }
+        output.writeByte(notEncoded);
+        for (size_t i = 0; i < size; i++) {
+            output.writeByte(text[i]);
+        }
+        output.flush();
+        return 0;
+    }
+
+    HuffmanTree tree(text, size, options.maxCodeLength); // создаем префиксное дерево и хеш таблицу для символов
+
+    // выбираем самый короткий из способов: как есть, сериями, общей таблицей или своими кодами Хаффмана
+    bool interleave = options.interleave && size >= EncodeOptions::minInterleaved;
+    size_t huffmanCost = (8 + tree.lengthsBits() + tree.messageBits() + 7) / 8 + (interleave ? 16 : 0);
+    size_t rawCost = size + 1;
+    size_t best = std::min({huffmanCost, rawCost, dictionaryCost});
+    if (runLengthCost(text, size, best) < best) {
+        encodeRuns(text, size, output);
+        return 0;
+    }
+    if (rawCost == best) {
+        output.writeByte(notEncoded);
+        output.writeBytes(text, size);
+        output.flush();
+        return 0;
+    }
+    if (dictionaryCost == best) {
+        encodeWithDictionary(text, size, *options.dictionary, output);
+        return 0;
+    }
+
+    if (interleave) {
+        encodeFourStreams(text, size, tree, output);
+        return tree.limitLoss;
+    }
+
+    //указываем формат и количество полезных бит в последнем байте
+    output.writeByte(canonical + tree.lastUsedBits(tree.lengthsBits()));
+    tree.lengthsWrite(output);
+
+    //записываем закодированный текст
+    for (size_t i = 0; i < size; i++) {
+        const MapNode &node = tree.codeMap[text[i]];
+        output.writeBits(node.code, node.size);
+    }
+    output.flush(); //сбрасываем буфер потока
+    return tree.limitLoss;
+}
+
+// выполняет work(i) для i < count: первый на текущем потоке, остальные на своих потоках
+template<class Work>
+void runParallel(size_t count, Work work) {
+    std::vector<std::future<void>> tasks;
+    for (size_t i = 1; i < count; i++) {
+        tasks.push_back(std::async(std::launch::async, work, i));
+    }
+    if (count > 0) {
+        work(0);
+    }
+    for (auto &task : tasks) {
+        task.get();
+    }
+}
+
+size_t threadsFor(unsigned requested) {
+    if (requested == 0) {
+        requested = std::thread::hardware_concurrency();
+    }
+    return std::max(requested, 1u);
+}
+
+// Вход длиннее одного блока режется на блоки, каждый кодируется отдельно:
+// framed, затем блоки [тип, длина текста, длина кода, код], в конце блок типа endBlock.
+// Блоки кодируются пачками по одному на поток и пишутся по порядку, так что результат
+// не зависит от числа потоков, а памяти нужно на threads блоков
+void Encode(IInputStream &original, IOutputStream &compressed, const EncodeOptions &options) {
+    size_t blockSize = std::max(options.blockSize, static_cast<size_t>(8));
+    size_t threads = threadsFor(options.threads);
+    std::vector<std::vector<byte>> blocks(std::max(threads, static_cast<size_t>(2)));
+    auto readBlock = [&](std::vector<byte> &block) {
+        block.resize(blockSize);
+        block.resize(readFull(original, block.data(), blockSize));
+        return block.size() == blockSize;
+    };
+
+    // весь текст уместился в один блок - пишем его без рамки
+    bool more = readBlock(blocks[0]) && readBlock(blocks[1]);
+    if (blocks[1].empty()) {
+        size_t loss = encodeBlock(blocks[0].data(), blocks[0].size(), compressed, options);
+        if (options.stats) {
+            options.stats->limitLossBits = loss;
+        }
+        return;
+    }
+
+    BitOutputStream output(compressed);
+    output.writeByte(framed);
+    std::vector<std::vector<byte>> payloads(blocks.size());
+    std::vector<size_t> losses(blocks.size());
+    size_t limitLoss = 0;
+    std::vector<byte> index; // [длина текста, длина блока целиком] для каждого блока
+    VectorOutput indexStream(&index);
+    BitOutputStream indexOutput(indexStream);
+    size_t blockCount = 0;
+    size_t count = 2;
+    while (count > 0) {
+        while (more && count < threads) {
+            more = readBlock(blocks[count]);
+            if (!blocks[count].empty()) {
+                count++;
+            }
+        }
+        auto encodeOne = [&](size_t i) {
+            payloads[i].clear();
+            VectorOutput payloadStream(&payloads[i]);
+            losses[i] = encodeBlock(blocks[i].data(), blocks[i].size(), payloadStream, options);
+        };
+        // первая пачка всегда из двух блоков; при одном потоке они кодируются по очереди
+        if (count > threads) {
+            for (size_t i = 0; i < count; i++) {
+                encodeOne(i);
+            }
+        } else {
+            runParallel(count, encodeOne);
+        }
+        for (size_t i = 0; i < count; i++) {
+            limitLoss += losses[i];
+            output.writeByte(huffmanBlock);
+            writeVarint(output, blocks[i].size());
+            writeVarint(output, payloads[i].size());
+            output.writeBytes(payloads[i].data(), payloads[i].size());
+            writeVarint(indexOutput, blocks[i].size());
+            writeVarint(indexOutput, 1 + varintSize(blocks[i].size()) + varintSize(payloads[i].size())
+                                     + payloads[i].size());
+            blockCount++;
+        }
+        count = 0;
+        if (more) {
+            more = readBlock(blocks[0]);
+            count = blocks[0].empty() ? 0 : 1;
+        }
+    }
+    output.writeByte(endBlock);
+
+    // индекс в конце: количество блоков и записи, затем 4 байта его длины и метка indexTrailer
+    std::vector<byte> trailer;
+    VectorOutput trailerStream(&trailer);
+    BitOutputStream trailerOutput(trailerStream);
+    writeVarint(trailerOutput, blockCount);
+    trailerOutput.flush();
+    indexOutput.flush();
+    trailer.insert(trailer.end(), index.begin(), index.end());
+    output.writeBytes(trailer.data(), trailer.size());
+    output.writeBits(trailer.size() & 0xffffffffu, 32);
+    output.writeByte(indexTrailer);
+    output.flush();
+    if (options.stats) {
+        options.stats->limitLossBits = limitLoss;
+    }
+}
+
+void Encode(IInputStream &original, IOutputStream &compressed) {
+    Encode(original, compressed, EncodeOptions());
+}
+
+// заголовок fourStreams после метки: длина текста, длины кодов и размеры первых трех потоков
+bool readFourStreamsHeader(BitInputStream &input, size_t &size, HuffmanTree &tree,
+                           std::array<size_t, 4> &streamSizes) {
+    if (!readVarint(input, size)) {
+        return false;
+    }
+    if (!tree.lengthsRead(input)) {
+        return false;
+    }
+    input.alignToByte();
+    for (size_t part = 0; part < 3; part++) {
+        if (!readVarint(input, streamSizes[part])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// четыре потока лежат подряд в streams; false, если код не разобрался
+bool decodeStreams(const DecodeTable &table, const byte *streams, const std::array<size_t, 4> &streamSizes,
+                   size_t size, byte *text) {
+    size_t quarter = (size + 3) / 4;
+    std::array<MemoryBitReader, 4> readers;
+    std::array<size_t, 4> counts{};
+    const byte *streamBegin = streams;
+    for (size_t part = 0; part < 4; part++) {
+        readers[part] = MemoryBitReader(streamBegin, streamBegin + streamSizes[part]);
+        streamBegin += streamSizes[part];
+        counts[part] = std::min(size, (part + 1) * quarter) - std::min(size, part * quarter);
+    }
+
+    std::array<byte *, 4> out;
+    for (size_t part = 0; part < 4; part++) {
+        out[part] = text + std::min(size, part * quarter);
+    }
+    // за одну дозагрузку окна в нем точно помещается perRefill кодов;
+    // последняя часть самая короткая, пока она не кончилась, символы есть во всех четырех
+    size_t perRefill = std::max(56 / std::max<size_t>(table.maxLength(), 1), static_cast<size_t>(1));
+    size_t done = 0;
+    byte symbol;
+    for (; done + perRefill <= counts[3]; done += perRefill) {
+        for (size_t part = 0; part < 4; part++) {
+            readers[part].refill();
+        }
+        for (size_t k = 0; k < perRefill; k++) {
+            for (size_t part = 0; part < 4; part++) {
+                if (!table.decode(readers[part], 64, symbol)) {
+                    return false;
+                }
+                *out[part]++ = symbol;
+            }
+        }
+    }
+    for (size_t part = 0; part < 4; part++) {
+        for (size_t i = done; i < counts[part]; i++) {
+            readers[part].refill();
+            if (!table.decode(readers[part], 64, symbol)) {
+                return false;
+            }
+            *out[part]++ = symbol;
+        }
+    }
+    return true;
+}
+
+bool decodeFourStreams(BitInputStream &input, ByteOutputBuffer &output, const DecodeOptions &options) {
+    size_t size;
+    HuffmanTree tree;
+    std::array<size_t, 4> streamSizes{};
+    if (!readFourStreamsHeader(input, size, tree, streamSizes) || size > options.maxBlockSize) {
+        return false;
+    }
+    std::vector<byte> payload;
+    std::array<byte, 1 << 12> chunk;
+    while (size_t got = input.readBytes(chunk.data(), chunk.size())) {
+        payload.insert(payload.end(), chunk.begin(), chunk.begin() + got);
+    }
+    // каждый код хотя бы один бит, поэтому символов не больше, чем бит в потоках
+    if (streamSizes[0] + streamSizes[1] + streamSizes[2] > payload.size() || size / 8 > payload.size()) {
+        return false;
+    }
+    streamSizes[3] = payload.size() - streamSizes[0] - streamSizes[1] - streamSizes[2];
+
+    std::vector<byte> text(size);
+    if (!decodeStreams(DecodeTable(tree.codeMap), payload.data(), streamSizes, size, text.data())) {
+        return false;
+    }
+    output.write(text.data(), text.size());
+    return true;
+}
+
+// декодирует поток одного блока, заголовок lastUsedBits уже прочитан
+bool decodeWithDictionary(BitInputStream &input, ByteOutputBuffer &output, const DecodeOptions &options) {
+    size_t id, size;
+    if (!options.dictionaries || !readVarint(input, id) || !readVarint(input, size) || size > options.maxBlockSize) {
+        return false;
+    }
+    const CodeDictionary *dictionary = options.dictionaries->find(static_cast<std::uint32_t>(id));
+    if (!dictionary) {
+        return false;
+    }
+    const DecodeTable &table = dictionary->decodeTable();
+    byte symbol;
+    for (size_t i = 0; i < size; i++) {
+        input.refill();
+        if (!table.decode(input, input.available(), symbol)) {
+            return false;
+        }
+        output.put(symbol);
+    }
+    return true;
+}
+
+// false - блок испорчен: заголовок не разбирается или в потоке нет целого кода
+bool decodeBlock(byte lastUsedBits, BitInputStream &input, ByteOutputBuffer &output, const DecodeOptions &options) {
+    //если данные не закодированы
+    if (lastUsedBits == notEncoded) {
+        std::array<byte, 1 << 12> chunk;
+        while (size_t got = input.readBytes(chunk.data(), chunk.size())) {
+            output.write(chunk.data(), got);
+        }
+        return true;
+    }
+
+    if (lastUsedBits == withDictionary) {
+        return decodeWithDictionary(input, output, options);
+    }
+
+    if (lastUsedBits == runLength) {
+        byte symbol;
+        size_t run;
+        size_t total = 0;
+        while (input.readByte(symbol) && readVarint(input, run)) {
+            if (run >= options.maxBlockSize - total) {
+                return false;
+            }
+            total += run + 1;
+            output.fill(symbol, run + 1);
+        }
+        return true;
+    }
+
+    //если данные состоят из одного символа
+    if (lastUsedBits >= oneSymbol && lastUsedBits < canonical) {
+        lastUsedBits -= oneSymbol;
+        byte symbol;
+        if (!input.readByte(symbol)) {
+            return false;
+        }
+        // каждый бит - один символ, кроме дополнения последнего байта
+        byte padding = (8 - lastUsedBits) % 8;
+        while (input.refill()) {
+            byte usable = input.available();
+            if (input.isExhausted()) {
+                usable = usable > padding ? usable - padding : 0;
+            }
+            for (byte i = 0; i < usable; i++) {
+                output.put(symbol);
+            }
+            input.skipBits(input.available());
+            if (usable == 0) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    if (lastUsedBits == fourStreams) {
+        return decodeFourStreams(input, output, options);
+    }
+
+    HuffmanTree tree;
+    if (lastUsedBits >= canonical && lastUsedBits < canonical + 8) {
+        lastUsedBits -= canonical;
+        if (!tree.lengthsRead(input)) {
+            return false;
+        }
+    } else {
+        tree.treeRead(input);
+    }
+    DecodeTable table(tree.codeMap);
+
+    // полезные биты кончаются за (8 - lastUsedBits) % 8 бит до конца потока
+    byte padding = (8 - lastUsedBits) % 8;
+    byte symbol;
+    while (input.refill()) {
+        byte usable = input.available();
+        if (input.isExhausted()) {
+            usable = usable > padding ? usable - padding : 0;
+        } else if (usable >= table.maxLength()) {
+            // пока в окне точно есть целый код, декодируем без дозагрузки
+            do {
+                if (!table.decode(input, usable, symbol)) {
+                    return false;
+                }
+                output.put(symbol);
+                usable = input.available();
+            } while (usable >= table.maxLength());
+            continue;
+        }
+        // в последних битах целого кода нет - это дополнение последнего байта
+        if (!table.decode(input, usable, symbol)) {
+            break;
+        }
+        output.put(symbol);
+    }
+    return true;
+}
+
+bool decodePayload(const byte *payload, size_t size, std::vector<byte> &text, const DecodeOptions &options) {
+    MemoryInput payloadStream(payload, size);
+    VectorOutput textStream(&text);
+    BitInputStream block(payloadStream);
+    ByteOutputBuffer blockOutput(textStream);
+    byte lastUsedBits = notEncoded;
+    block.readByte(lastUsedBits);
+    return decodeBlock(lastUsedBits, block, blockOutput, options);
+}
+
+// длины в заголовках блоков позволяют сначала прочитать пачку блоков, а потом раздать их потокам
+// Длины из заголовка блока проверяются по options.maxBlockSize, а память под блок растет
+// по мере того, как его байты действительно приходят, поэтому обрезанный поток много не займет.
+// false - испорчен блок, заголовок блока или поток кончился раньше endBlock
+bool decodeFramed(BitInputStream &input, ByteOutputBuffer &output, const DecodeOptions &options) {
+    size_t threads = threadsFor(options.threads);
+    std::vector<std::vector<byte>> payloads(threads);
+    std::vector<std::vector<byte>> texts(threads);
+    std::vector<size_t> sizes(threads);
+    std::vector<byte> valid(threads);
+    bool more = true;
+    bool complete = true;
+    while (more) {
+        size_t count = 0;
+        byte type;
+        size_t payloadSize;
+        while (count < threads) {
+            if (!input.readByte(type)) {
+                more = complete = false;
+                break;
+            }
+            if (type == endBlock) {
+                more = false;
+                break;
+            }
+            if (type != huffmanBlock || !readVarint(input, sizes[count]) || !readVarint(input, payloadSize)
+                || sizes[count] > options.maxBlockSize || payloadSize > blockBound(options.maxBlockSize)) {
+                more = complete = false;
+                break;
+            }
+            std::vector<byte> &payload = payloads[count];
+            payload.clear();
+            while (payload.size() < payloadSize) {
+                size_t part = std::min(payloadSize - payload.size(), static_cast<size_t>(1) << 16);
+                size_t done = payload.size();
+                payload.resize(done + part);
+                payload.resize(done + input.readBytes(payload.data() + done, part));
+                if (payload.size() < done + part) {
+                    break;
+                }
+            }
+            if (payload.size() < payloadSize) {
+                more = complete = false;
+                break;
+            }
+            count++;
+        }
+        runParallel(count, [&](size_t i) {
+            texts[i].clear();
+            texts[i].reserve(sizes[i]);
+            valid[i] = decodePayload(payloads[i].data(), payloads[i].size(), texts[i], options);
+        });
+        // после испорченного блока ничего не пишем
+        for (size_t i = 0; i < count; i++) {
+            output.write(texts[i].data(), texts[i].size());
+            if (!valid[i]) {
+                return false;
+            }
+        }
+    }
+    return complete;
+}
+
+// false, если поток пуст, обрезан или испорчен; текст до места ошибки уже записан в original
+bool Decode(IInputStream &compressed, IOutputStream &original, const DecodeOptions &options) {
+    BitInputStream input(compressed);
+    ByteOutputBuffer output(original);
+    byte lastUsedBits = notEncoded;
+    if (!input.readByte(lastUsedBits)) {
+        return false;
+    }
+    if (lastUsedBits == framed) {
+        return decodeFramed(input, output, options);
+    }
+    return decodeBlock(lastUsedBits, input, output, options);
+}
+
+bool Decode(IInputStream &compressed, IOutputStream &original) {
+    return Decode(compressed, original, DecodeOptions());
+}
+
+size_t parseVarint(const byte *data, size_t size, size_t &pos, bool &ok) {
+    size_t value = 0;
+    for (byte shift = 0; shift < 64 && pos < size; shift += 7) {
+        byte next = data[pos++];
+        value |= static_cast<size_t>(next & 0x7f) << shift;
+        if (!(next & 0x80)) {
+            return value;
+        }
+    }
+    ok = false;
+    return 0;
+}
+
+// Блоки рамки: где начинается блок в сжатом потоке и сколько в нем текста.
+// Берутся из индекса в конце потока, а без индекса - проходом по заголовкам блоков
+std::vector<std::pair<size_t, size_t>> blockIndex(const byte *compressed, size_t size) {
+    std::vector<std::pair<size_t, size_t>> blocks;
+    bool ok = true;
+    if (size >= 9 && compressed[size - 1] == indexTrailer) {
+        size_t indexSize = static_cast<size_t>(loadWord(compressed + size - 9) >> 32);
+        if (indexSize <= size - 6) {
+            size_t pos = size - 5 - indexSize;
+            size_t end = size - 5;
+            size_t count = parseVarint(compressed, end, pos, ok);
+            size_t frame = 1;
+            for (size_t i = 0; i < count && ok; i++) {
+                size_t rawSize = parseVarint(compressed, end, pos, ok);
+                size_t frameSize = parseVarint(compressed, end, pos, ok);
+                blocks.push_back({frame, rawSize});
+                frame += frameSize;
+            }
+            if (ok) {
+                return blocks;
+            }
+        }
+    }
+    blocks.clear();
+    ok = true;
+    size_t pos = 1;
+    while (pos < size && compressed[pos] != endBlock && ok) {
+        size_t frame = pos++;
+        size_t rawSize = parseVarint(compressed, size, pos, ok);
+        size_t payloadSize = parseVarint(compressed, size, pos, ok);
+        blocks.push_back({frame, rawSize});
+        pos += payloadSize;
+    }
+    return blocks;
+}
+
+// Выдает length байт исходного текста начиная с offset. В сжатом потоке с рамкой
+// декодируются только блоки, которые пересекают этот диапазон
+void DecodeRange(const byte *compressed, size_t size, size_t offset, size_t length, IOutputStream &original,
+                 const DecodeOptions &options = DecodeOptions()) {
+    std::vector<byte> text;
+    if (size == 0 || length == 0) {
+        return;
+    }
+    if (compressed[0] != framed) {
+        MemoryInput input(compressed, size);
+        VectorOutput output(&text);
+        Decode(input, output, options);
+        if (offset < text.size()) {
+            original.Write(text.data() + offset, std::min(length, text.size() - offset));
+        }
+        return;
+    }
+
+    // length = SIZE_MAX - до конца текста, поэтому конец диапазона не должен переполниться
+    size_t end = length > SIZE_MAX - offset ? SIZE_MAX : offset + length;
+    size_t blockBegin = 0;
+    for (auto &block : blockIndex(compressed, size)) {
+        size_t blockEnd = blockBegin + block.second;
+        if (blockEnd > offset && blockBegin < end) {
+            bool ok = true;
+            size_t pos = block.first + 1;
+            parseVarint(compressed, size, pos, ok);
+            size_t payloadSize = parseVarint(compressed, size, pos, ok);
+            if (!ok || payloadSize > size - pos) {
+                return;
+            }
+            text.clear();
+            bool valid = decodePayload(compressed + pos, payloadSize, text, options);
+            size_t from = std::max(offset, blockBegin) - blockBegin;
+            size_t to = std::min(std::min(end, blockEnd) - blockBegin, text.size());
+            if (from < to) {
+                original.Write(text.data() + from, to - from);
+            }
+            if (!valid) {
+                return;
+            }
+        }
+        if (blockEnd >= end) {
+            break;
+        }
+        blockBegin = blockEnd;
+    }
+}
+
+// Декодер, которому сжатый поток подается кусками любой длины: feed забирает вход,
+// read отдает готовый текст. Между вызовами хранится разобранная часть заголовка блока,
+// принятая часть блока и еще не отданный текст, так что памяти нужно на один блок,
+// а не на все сообщение. Длина блока в его заголовке говорит, когда блок пришел целиком,
+// поэтому конец потока ждать не нужно. Поток без рамки, в том числе старого формата до рамок,
+// декодируется целиком только после finish, поэтому он принимается, пока не длиннее
+// blockBound(options.maxBlockSize), как и один блок рамки
+class HuffmanDecoder {
+public:
+    explicit HuffmanDecoder(const DecodeOptions &options = DecodeOptions())
+            : options(options), state(streamStart), rawSize(0), payloadSize(0), textPos(0) {}
+
+    // возвращает сколько байт входа принято; пока текст блока не забран через read,
+    // следующий блок не принимается, и остаток входа надо подать еще раз.
+    // 0 при непустом входе и пустом read - поток испорчен, см. failed
+    size_t feed(const byte *data, size_t size) {
+        size_t used = 0;
+        while (used < size && textPos == text.size() && state != broken) {
+            switch (state) {
+                case streamStart:
+                    if (data[used] == framed) {
+                        used++;
+                        state = frameHeader;
+                    } else {
+                        state = wholeStream;
+                    }
+                    break;
+                case wholeStream:
+                    if (size - used > blockBound(options.maxBlockSize) - payload.size()) {
+                        state = broken;
+                        break;
+                    }
+                    payload.insert(payload.end(), data + used, data + size);
+                    used = size;
+                    break;
+                case frameHeader:
+                    header.push_back(data[used++]);
+                    parseHeader();
+                    break;
+                case framePayload: {
+                    size_t part = std::min(size - used, payloadSize - payload.size());
+                    payload.insert(payload.end(), data + used, data + used + part);
+                    used += part;
+                    if (payload.size() == payloadSize) {
+                        decodeFrame();
+                    }
+                    break;
+                }
+                default:
+                    // после endBlock идет только индекс блоков, для чтения по порядку он не нужен
+                    used = size;
+                    break;
+            }
+        }
+        return used;
+    }
+
+    // отдает до capacity байт текста, 0 - готового текста пока нет
+    size_t read(byte *dst, size_t capacity) {
+        size_t part = std::min(capacity, text.size() - textPos);
+        if (part == 0) {
+            return 0;
+        }
+        std::memcpy(dst, text.data() + textPos, part);
+        textPos += part;
+        return part;
+    }
+
+    // входа больше не будет; пустой поток и поток с рамкой без endBlock испорчены, как и в Decode,
+    // а недопринятый блок отбрасывается
+    void finish() {
+        if (state == streamStart || state == frameHeader || state == framePayload) {
+            state = broken;
+        }
+        if (state == wholeStream) {
+            text.clear();
+            textPos = 0;
+            if (!decodePayload(payload.data(), payload.size(), text, options)) {
+                state = broken;
+            }
+        }
+        if (state != broken) {
+            state = finished;
+        }
+    }
+
+    // поток закончился и весь текст отдан
+    bool done() const {
+        return (state == finished || state == broken) && textPos == text.size();
+    }
+
+    // заголовок блока не разбирается или блок испорчен
+    bool failed() const {
+        return state == broken;
+    }
+
+private:
+    enum State {
+        streamStart,
+        wholeStream,
+        frameHeader,
+        framePayload,
+        finished,
+        broken
+    };
+
+    // тип блока и два varint по 10 байт самое большее
+    static constexpr size_t maxHeaderSize = 21;
+
+    void parseHeader() {
+        if (header[0] == endBlock) {
+            state = finished;
+            return;
+        }
+        if (header[0] != huffmanBlock) {
+            state = broken;
+            return;
+        }
+        bool ok = true;
+        size_t pos = 1;
+        rawSize = parseVarint(header.data(), header.size(), pos, ok);
+        payloadSize = parseVarint(header.data(), header.size(), pos, ok);
+        if (!ok) {
+            if (header.size() >= maxHeaderSize) {
+                state = broken;
+            }
+            return;
+        }
+        if (rawSize > options.maxBlockSize || payloadSize > blockBound(options.maxBlockSize)) {
+            state = broken;
+            return;
+        }
+        header.clear();
+        payload.clear();
+        state = framePayload;
+        if (payloadSize == 0) {
+            decodeFrame();
+        }
+    }
+
+    void decodeFrame() {
+        text.clear();
+        textPos = 0;
+        text.reserve(rawSize);
+        bool valid = decodePayload(payload.data(), payload.size(), text, options);
+        payload.clear();
+        state = valid ? frameHeader : broken;
+    }
+
+    DecodeOptions options;
+    State state;
+    std::vector<byte> header;  // принятая часть заголовка блока
+    std::vector<byte> payload; // принятая часть блока или весь поток без рамки
+    std::vector<byte> text;    // декодированный блок, отдается через read
+    size_t rawSize;
+    size_t payloadSize;
+    size_t textPos;
+};
+
+// varint прямо в память, возвращает его длину
+size_t putVarint(byte *dst, size_t value) {
+    size_t size = 0;
+    while (value >= 0x80) {
+        dst[size++] = static_cast<byte>(value | 0x80);
+        value >>= 7;
+    }
+    dst[size++] = static_cast<byte>(value);
+    return size;
+}
+
+// Сколько байт нужно под сжатый текст длины size при делении на блоки по blockSize
+size_t compressBound(size_t size, size_t blockSize = EncodeOptions().blockSize) {
+    blockSize = std::max(blockSize, static_cast<size_t>(8));
+    if (size <= blockSize) {
+        return blockBound(size);
+    }
+    size_t blocks = (size + blockSize - 1) / blockSize;
+    size_t rest = size % blockSize;
+    size_t payloads = size / blockSize * blockBound(blockSize) + (rest > 0 ? blockBound(rest) : 0);
+    // у каждого блока тип и две длины в заголовке и две длины в записи индекса
+    size_t frameHeader = 1 + varintSize(blockSize) + varintSize(blockBound(blockSize));
+    size_t indexEntry = varintSize(blockSize) + varintSize(frameHeader + blockBound(blockSize));
+    // framed, блоки, endBlock, число блоков, индекс, его длина и indexTrailer
+    return 1 + payloads + blocks * (frameHeader + indexEntry) + 1 + varintSize(blocks) + 4 + 1;
+}
+
+// Кодирует текст из памяти в буфер вызывающего: тот же формат, что у Encode, в один поток,
+// options.threads не используется. Блоки кодируются прямо на место в compressed, память
+// под них не выделяется. Возвращает длину сжатого текста или SIZE_MAX, если он не поместился;
+// capacity >= compressBound(size, options.blockSize) хватает всегда
+size_t Encode(const byte *original, size_t size, byte *compressed, size_t capacity,
+              const EncodeOptions &options = EncodeOptions()) {
+    size_t blockSize = std::max(options.blockSize, static_cast<size_t>(8));
+    if (size <= blockSize) {
+        MemoryOutput output(compressed, capacity);
+        size_t loss = encodeBlock(original, size, output, options);
+        if (options.stats) {
+            options.stats->limitLossBits = loss;
+        }
+        return output.overflowed() ? SIZE_MAX : output.size();
+    }
+
+    size_t blocks = (size + blockSize - 1) / blockSize;
+    if (capacity == 0) {
+        return SIZE_MAX;
+    }
+    compressed[0] = framed;
+    size_t pos = 1;
+    size_t limitLoss = 0;
+    for (size_t begin = 0; begin < size; begin += blockSize) {
+        size_t rawSize = std::min(blockSize, size - begin);
+        // код пишется после заголовка с самой длинной длиной кода и потом сдвигается к заголовку
+        size_t reserved = 1 + varintSize(rawSize) + varintSize(blockBound(rawSize));
+        if (capacity - pos < reserved) {
+            return SIZE_MAX;
+        }
+        MemoryOutput payload(compressed + pos + reserved, capacity - pos - reserved);
+        limitLoss += encodeBlock(original + begin, rawSize, payload, options);
+        if (payload.overflowed()) {
+            return SIZE_MAX;
+        }
+        size_t header = 1 + varintSize(rawSize) + varintSize(payload.size());
+        std::memmove(compressed + pos + header, compressed + pos + reserved, payload.size());
+        compressed[pos] = huffmanBlock;
+        size_t headerPos = pos + 1;
+        headerPos += putVarint(compressed + headerPos, rawSize);
+        putVarint(compressed + headerPos, payload.size());
+        pos += header + payload.size();
+    }
+
+    // индекс как у Encode по потокам; записи берутся из уже записанных заголовков блоков
+    size_t blocksEnd = pos;
+    auto forEachBlock = [&](auto visit) {
+        size_t frame = 1;
+        for (size_t i = 0; i < blocks; i++) {
+            bool ok = true;
+            size_t at = frame + 1;
+            size_t rawSize = parseVarint(compressed, blocksEnd, at, ok);
+            size_t frameSize = parseVarint(compressed, blocksEnd, at, ok) + at - frame;
+            visit(rawSize, frameSize);
+            frame += frameSize;
+        }
+    };
+    size_t indexSize = varintSize(blocks);
+    forEachBlock([&](size_t rawSize, size_t frameSize) {
+        indexSize += varintSize(rawSize) + varintSize(frameSize);
+    });
+    if (capacity - pos < 1 + indexSize + 4 + 1) {
+        return SIZE_MAX;
+    }
+    compressed[pos++] = endBlock;
+    pos += putVarint(compressed + pos, blocks);
+    forEachBlock([&](size_t rawSize, size_t frameSize) {
+        pos += putVarint(compressed + pos, rawSize);
+        pos += putVarint(compressed + pos, frameSize);
+    });
+    for (int shift = 0; shift < 32; shift += 8) {
+        compressed[pos++] = static_cast<byte>(indexSize >> shift);
+    }
+    compressed[pos++] = indexTrailer;
+    if (options.stats) {
+        options.stats->limitLossBits = limitLoss;
+    }
+    return pos;
+}
+
+// один поток блока целиком в памяти; fourStreams декодируется сразу в text
+size_t decodeBlockTo(const byte *block, size_t size, byte *text, size_t capacity, const DecodeOptions &options) {
+    MemoryInput input(block, size);
+    BitInputStream bits(input);
+    byte lastUsedBits = notEncoded;
+    bits.readByte(lastUsedBits);
+    if (lastUsedBits == fourStreams) {
+        size_t textSize;
+        HuffmanTree tree;
+        std::array<size_t, 4> streamSizes{};
+        if (!readFourStreamsHeader(bits, textSize, tree, streamSizes)) {
+            return SIZE_MAX;
+        }
+        size_t streamsBegin = bits.position();
+        size_t rest = size - streamsBegin;
+        if (streamSizes[0] > rest || streamSizes[1] > rest - streamSizes[0]
+            || streamSizes[2] > rest - streamSizes[0] - streamSizes[1]) {
+            return SIZE_MAX;
+        }
+        streamSizes[3] = rest - streamSizes[0] - streamSizes[1] - streamSizes[2];
+        if (textSize > capacity || textSize > options.maxBlockSize || textSize / 8 > rest) {
+            return SIZE_MAX;
+        }
+        return decodeStreams(DecodeTable(tree.codeMap), block + streamsBegin, streamSizes, textSize, text)
+               ? textSize : SIZE_MAX;
+    }
+
+    MemoryOutput textStream(text, capacity);
+    bool valid;
+    {
+        ByteOutputBuffer output(textStream);
+        valid = decodeBlock(lastUsedBits, bits, output, options);
+    }
+    return !valid || textStream.overflowed() ? SIZE_MAX : textStream.size();
+}
+
+// Декодирует сжатый текст из памяти в буфер вызывающего, в один поток. Память не выделяется,
+// если длины кодов не больше DecodeTable::tableBits, как у всего, что кодирует Encode по умолчанию;
+// более длинным кодам нужны таблицы следующих уровней. Возвращает длину текста
+// или SIZE_MAX, если он не поместился в capacity или поток испорчен
+size_t Decode(const byte *compressed, size_t size, byte *original, size_t capacity,
+              const DecodeOptions &options = DecodeOptions()) {
+    if (size == 0 || compressed[0] != framed) {
+        return decodeBlockTo(compressed, size, original, capacity, options);
+    }
+    size_t written = 0;
+    size_t pos = 1;
+    while (pos < size && compressed[pos] != endBlock) {
+        bool ok = true;
+        pos++;
+        parseVarint(compressed, size, pos, ok);
+        size_t payloadSize = parseVarint(compressed, size, pos, ok);
+        if (!ok || payloadSize > size - pos) {
+            break;
+        }
+        size_t got = decodeBlockTo(compressed + pos, payloadSize, original + written, capacity - written, options);
+        if (got == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        written += got;
+        pos += payloadSize;
+    }
+    return written;
+}